@@ -0,0 +1,323 @@
+// Checks that the block-at-a-time MS-ADPCM decoder in wave_decoder.cpp gives
+// exactly the same samples as the original decoder, which went a nibble at a
+// time through per-channel state pointers. The original is kept here as the
+// reference, along with just enough of a RIFF reader to feed it.
+//
+//     adpcm_check Assets/grass_adpcm.wav
+
+#include "wave_decoder.h"
+#include "file_mapping.h"
+#include "sized_types.h"
+#include "logging.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#define ALLOCATE(type, count) \
+    static_cast<type*>(std::calloc((count), sizeof(type)))
+
+#define DEALLOCATE(memory) \
+    std::free(memory)
+
+#define WAVE_FORMAT_ADPCM 0x0002
+
+// Reference Decoder...........................................................
+
+struct MsAdpcmData {
+    s16 coefficients[256][2];
+    u16 num_coefficients;
+    u16 frames_per_block;
+};
+
+struct MsAdpcmState {
+    u16 delta;
+    s16 sample1;
+    s16 sample2;
+    u8 predictor;
+};
+
+static s16 ms_adpcm_decode_sample(MsAdpcmState* state, u8 code,
+                                  const s16* coefficient_set) {
+    const s32 MAX_S16 = 32767;
+    const s32 MIN_S16 = -32768;
+    const s32 adaption_table[16] = {
+        230, 230, 230, 230, 307, 409, 512, 614,
+        768, 614, 512, 409, 307, 230, 230, 230
+    };
+
+    s32 predicted_sample;
+    predicted_sample = (state->sample1 * coefficient_set[0] +
+                        state->sample2 * coefficient_set[1]) / 256;
+    if (code & 0x08) {
+        predicted_sample += state->delta * (code - 0x10);
+    } else {
+        predicted_sample += state->delta * code;
+    }
+    if (predicted_sample < MIN_S16) {
+        predicted_sample = MIN_S16;
+    } else if (predicted_sample > MAX_S16) {
+        predicted_sample = MAX_S16;
+    }
+
+    s32 delta;
+    delta = (static_cast<s32>(state->delta) * adaption_table[code]) / 256;
+    if (delta < 16) {
+        delta = 16;
+    }
+
+    state->delta = delta;
+    state->sample2 = state->sample1;
+    state->sample1 = predicted_sample;
+
+    return static_cast<s16>(predicted_sample);
+}
+
+// The decoded buffer needs room for one sample more than a block, since for
+// mono blocks with an odd number of frames this writes past the last one.
+static void ms_adpcm_decode_block(MsAdpcmData* adpcm_data, int channels,
+                                  const u8* encoded, s16* decoded) {
+    MsAdpcmState* state[2];
+    MsAdpcmState decoder_state[2];
+    state[0] = &decoder_state[0];
+    if (channels == 2) {
+        state[1] = &decoder_state[1];
+    } else {
+        state[1] = &decoder_state[0];
+    }
+
+    for (int i = 0; i < channels; ++i) {
+        state[i]->predictor = *encoded++;
+    }
+
+    for (int i = 0; i < channels; ++i) {
+        state[i]->delta = (encoded[1] << 8) | encoded[0];
+        encoded += sizeof(u16);
+    }
+
+    for (int i = 0; i < channels; ++i) {
+        state[i]->sample1 = (encoded[1] << 8) | encoded[0];
+        encoded += sizeof(s16);
+    }
+    for (int i = 0; i < channels; ++i) {
+        state[i]->sample2 = (encoded[1] << 8) | encoded[0];
+        encoded += sizeof(s16);
+    }
+
+    s16* coefficient[2];
+    coefficient[0] = adpcm_data->coefficients[state[0]->predictor];
+    coefficient[1] = adpcm_data->coefficients[state[1]->predictor];
+
+    for (int i = 0; i < channels; ++i) {
+        *decoded++ = state[i]->sample2;
+    }
+    for (int i = 0; i < channels; ++i) {
+        *decoded++ = state[i]->sample1;
+    }
+
+    int samples_remaining = (adpcm_data->frames_per_block - 2) * channels;
+    while (samples_remaining > 0) {
+        u8 code;
+        code = *encoded >> 4;
+        *decoded++ = ms_adpcm_decode_sample(state[0], code, coefficient[0]);
+        code = *encoded & 0x0F;
+        *decoded++ = ms_adpcm_decode_sample(state[1], code, coefficient[1]);
+
+        ++encoded;
+        samples_remaining -= 2;
+    }
+}
+
+// The same conversion wave_decode_interleaved does for 16-bit samples.
+static float format_s16(s16 value) {
+    const float scale = static_cast<float>(1.0 / 32767.5);
+    return (static_cast<float>(value) + 0.5f) * scale;
+}
+
+// Reading The File............................................................
+
+struct AdpcmFile {
+    MsAdpcmData adpcm_data;
+    const u8* data;
+    u32 data_size;
+    u32 frame_count;
+    u16 block_alignment;
+    int channels;
+};
+
+static u16 read16(const u8* bytes) {
+    return bytes[0] | bytes[1] << 8;
+}
+
+static u32 read32(const u8* bytes) {
+    return read16(bytes) | static_cast<u32>(read16(bytes + 2)) << 16;
+}
+
+static bool read_adpcm_file(AdpcmFile* file, FileMapping* mapping) {
+    const u8* bytes = static_cast<const u8*>(mapping->data);
+    std::size_t size = mapping->size;
+    if (size < 12 || std::memcmp(bytes, "RIFF", 4) != 0 ||
+            std::memcmp(bytes + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    bool format_found = false;
+    file->data = nullptr;
+    file->frame_count = 0;
+    std::size_t position = 12;
+    while (position + 8 <= size) {
+        const u8* chunk = bytes + position;
+        u32 chunk_size = read32(chunk + 4);
+        const u8* contents = chunk + 8;
+        if (chunk_size > size - position - 8) {
+            return false;
+        }
+        if (std::memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 22 || read16(contents) != WAVE_FORMAT_ADPCM) {
+                return false;
+            }
+            file->channels = read16(contents + 2);
+            file->block_alignment = read16(contents + 12);
+            MsAdpcmData* adpcm_data = &file->adpcm_data;
+            adpcm_data->frames_per_block = read16(contents + 18);
+            adpcm_data->num_coefficients = read16(contents + 20);
+            if (adpcm_data->num_coefficients > 255 ||
+                    chunk_size < 22u + 4 * adpcm_data->num_coefficients) {
+                return false;
+            }
+            for (int i = 0; i < adpcm_data->num_coefficients; ++i) {
+                const u8* pair = contents + 22 + 4 * i;
+                adpcm_data->coefficients[i][0] = read16(pair);
+                adpcm_data->coefficients[i][1] = read16(pair + 2);
+            }
+            format_found = true;
+        } else if (std::memcmp(chunk, "fact", 4) == 0 && chunk_size >= 4) {
+            file->frame_count = read32(contents);
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            file->data = contents;
+            file->data_size = chunk_size;
+        }
+        position += 8 + chunk_size + (chunk_size & 1);
+    }
+    return format_found && file->data &&
+           (file->channels == 1 || file->channels == 2) &&
+           file->block_alignment > 7u * file->channels;
+}
+
+// Decodes the whole file with the reference decoder, padding out a truncated
+// last block with silence like the wave decoder does.
+static s16* decode_reference(AdpcmFile* file, u32* frame_count) {
+    u32 frames_per_block = file->adpcm_data.frames_per_block;
+    u32 block_count = (file->data_size + file->block_alignment - 1) /
+                      file->block_alignment;
+    u32 total_frames = frames_per_block * block_count;
+    s16* samples = ALLOCATE(s16, file->channels * total_frames + 1);
+    u8* padded = ALLOCATE(u8, file->block_alignment);
+    for (u32 i = 0; i < block_count; ++i) {
+        const u8* block = file->data + file->block_alignment * i;
+        u32 left = file->data_size - file->block_alignment * i;
+        if (left < file->block_alignment) {
+            std::memset(padded, 0, file->block_alignment);
+            std::memcpy(padded, block, left);
+            block = padded;
+        }
+        ms_adpcm_decode_block(&file->adpcm_data, file->channels, block,
+                              samples + file->channels * frames_per_block * i);
+    }
+    DEALLOCATE(padded);
+    *frame_count = total_frames;
+    return samples;
+}
+
+// Decodes the file through the wave decoder, into the given number of output
+// channels, a period-sized piece at a time like the mixer does, and compares
+// every sample to the reference.
+static bool compare_decode(const char* filename, AdpcmFile* file,
+                           const s16* reference, u32 reference_frames,
+                           int out_channels) {
+    WaveDecoder* decoder = wave_open_file(filename);
+    if (!decoder) {
+        LOG_ERROR("The wave decoder couldn't open %s.", filename);
+        return false;
+    }
+    u32 frame_count = wave_frame_count(decoder);
+    if (frame_count > reference_frames) {
+        LOG_ERROR("The wave decoder has %u frames, but the file only holds %u.",
+                  frame_count, reference_frames);
+        wave_close_file(decoder);
+        return false;
+    }
+
+    const int frames_per_piece = 1000;
+    float buffer[2 * frames_per_piece];
+    u32 frame = 0;
+    bool matched = true;
+    while (matched) {
+        int frames = wave_decode_interleaved(decoder, out_channels, buffer,
+                                             out_channels * frames_per_piece);
+        if (frames <= 0) {
+            break;
+        }
+        for (int i = 0; i < frames && matched; ++i) {
+            for (int j = 0; j < out_channels; ++j) {
+                s16 sample = reference[file->channels * (frame + i) + j];
+                float expected = format_s16(sample);
+                if (buffer[out_channels * i + j] != expected) {
+                    LOG_ERROR("Decoding into %i channels, frame %u channel %i "
+                              "is %f but should be %f.", out_channels,
+                              frame + i, j, buffer[out_channels * i + j],
+                              expected);
+                    matched = false;
+                    break;
+                }
+            }
+        }
+        frame += frames;
+    }
+    if (matched && frame != frame_count) {
+        LOG_ERROR("Decoding into %i channels gave %u frames instead of %u.",
+                  out_channels, frame, frame_count);
+        matched = false;
+    }
+    wave_close_file(decoder);
+    return matched;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        LOG_ERROR("Usage: %s adpcm.wav", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* filename = argv[1];
+
+    FileMapping mapping;
+    if (!map_file(&mapping, filename)) {
+        LOG_ERROR("Couldn't open %s.", filename);
+        return EXIT_FAILURE;
+    }
+    AdpcmFile file;
+    if (!read_adpcm_file(&file, &mapping)) {
+        LOG_ERROR("%s isn't a mono or stereo MS-ADPCM wave file.", filename);
+        unmap_file(&mapping);
+        return EXIT_FAILURE;
+    }
+
+    u32 reference_frames;
+    s16* reference = decode_reference(&file, &reference_frames);
+
+    // Decode once in the file's own layout, and once downmixed to its first
+    // channel, since the two take different paths out of the decoded block.
+    bool matched = compare_decode(filename, &file, reference, reference_frames,
+                                  file.channels);
+    if (matched && file.channels == 2) {
+        matched = compare_decode(filename, &file, reference, reference_frames,
+                                 1);
+    }
+
+    DEALLOCATE(reference);
+    unmap_file(&mapping);
+    if (!matched) {
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Every sample of %s matched the reference decoder.", filename);
+    return 0;
+}
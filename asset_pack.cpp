@@ -0,0 +1,106 @@
+#include "asset_pack.h"
+
+#include "logging.h"
+
+#include <cstring>
+
+namespace {
+    FileMapping pack;
+    const AssetPackEntry* entries;
+    const char* paths;
+    int entry_count;
+}
+
+// Checks every entry lies within the pack and that the index is in order, so
+// that lookups can trust it and a damaged pack can't lead to reading past the
+// end of the mapping.
+static bool check_index(const uint8_t* base, std::size_t size) {
+    const AssetPackHeader* header =
+        reinterpret_cast<const AssetPackHeader*>(base);
+    std::size_t index_size = sizeof(AssetPackEntry) * header->entry_count;
+    std::size_t paths_start = sizeof *header + index_size;
+    if (paths_start > size || header->paths_size > size - paths_start) {
+        return false;
+    }
+    const AssetPackEntry* index =
+        reinterpret_cast<const AssetPackEntry*>(base + sizeof *header);
+    const char* path_base = reinterpret_cast<const char*>(base + paths_start);
+    for (uint32_t i = 0; i < header->entry_count; ++i) {
+        const AssetPackEntry* entry = index + i;
+        if (entry->offset % ASSET_PACK_ALIGNMENT != 0 ||
+                entry->offset > size || entry->size > size - entry->offset ||
+                entry->path_offset >= header->paths_size ||
+                entry->path_size >= header->paths_size - entry->path_offset ||
+                path_base[entry->path_offset + entry->path_size] != '\0') {
+            return false;
+        }
+        if (i > 0 && std::strcmp(path_base + index[i - 1].path_offset,
+                                 path_base + entry->path_offset) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool open_asset_pack(const char* filename) {
+    close_asset_pack();
+
+    FileMapping mapping;
+    if (!map_file(&mapping, filename)) {
+        return false;
+    }
+
+    const uint8_t* base = static_cast<const uint8_t*>(mapping.data);
+    const AssetPackHeader* header =
+        static_cast<const AssetPackHeader*>(mapping.data);
+    if (mapping.size < sizeof *header ||
+            header->magic != ASSET_PACK_MAGIC ||
+            header->version != ASSET_PACK_VERSION ||
+            !check_index(base, mapping.size)) {
+        LOG_ERROR("The asset pack %s is damaged or out of date.", filename);
+        unmap_file(&mapping);
+        return false;
+    }
+
+    pack = mapping;
+    entries = reinterpret_cast<const AssetPackEntry*>(base + sizeof *header);
+    paths = reinterpret_cast<const char*>(entries + header->entry_count);
+    entry_count = header->entry_count;
+    return true;
+}
+
+void close_asset_pack() {
+    unmap_file(&pack);
+    entries = nullptr;
+    paths = nullptr;
+    entry_count = 0;
+}
+
+bool find_packed_file(FileMapping* mapping, const char* path) {
+    mapping->data = nullptr;
+    mapping->size = 0;
+    mapping->owned = false;
+
+    int first = 0;
+    int last = entry_count - 1;
+    while (first <= last) {
+        int middle = first + (last - first) / 2;
+        const AssetPackEntry* entry = entries + middle;
+        int order = std::strcmp(path, paths + entry->path_offset);
+        if (order < 0) {
+            last = middle - 1;
+        } else if (order > 0) {
+            first = middle + 1;
+        } else {
+            if (entry->size == 0) {
+                // Like an empty file, there would be nothing to read.
+                return false;
+            }
+            uint8_t* base = static_cast<uint8_t*>(pack.data);
+            mapping->data = base + entry->offset;
+            mapping->size = entry->size;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "file_mapping.h"
+
+#include <cstdint>
+
+// An asset pack is every file under Assets/ put end to end in one file, which
+// is opened by mapping the whole thing in. Files are found in it by the path
+// they would otherwise be loaded from, and come back as views straight into
+// the mapping, so nothing is read or copied to load from the pack.
+//
+// The pack starts with a header, then an index of every file sorted by path,
+// then the paths themselves, each ending in a null. Every file's contents
+// start on a page boundary, so that a view into the pack can be advised or
+// locked like a mapping of the file itself.
+//
+// Every field is in the byte order of the machine which wrote the pack.
+
+#define ASSET_PACK_MAGIC 0x4B504D41 // "AMPK"
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_ALIGNMENT 4096
+
+struct AssetPackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t paths_size; // the paths follow straight after the index
+};
+
+struct AssetPackEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t path_offset; // from the start of the paths
+    uint32_t path_size; // not counting the null on the end
+};
+
+// Only one pack is open at a time, and while it is, it's safe to look files
+// up in it from any thread.
+bool open_asset_pack(const char* filename);
+void close_asset_pack();
+
+// Files which aren't in the pack, or any file while no pack is open, have to
+// be loaded from where they are on their own.
+bool find_packed_file(FileMapping* mapping, const char* path);
@@ -0,0 +1,203 @@
+// Packs every file under a directory into one asset pack, which
+// open_asset_pack maps straight in. Files are stored under their paths as
+// given here, so packing Assets from where the game runs stores each file under
+// the path the game would load it from.
+//
+//     asset_packer Assets output.pack
+
+#include "asset_pack.h"
+#include "file_mapping.h"
+#include "logging.h"
+#include "string_utilities.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#define ALLOCATE(type, count) \
+    static_cast<type*>(std::malloc(sizeof(type) * (count)))
+
+#define REALLOCATE(memory, type, count) \
+    static_cast<type*>(std::realloc((memory), sizeof(type) * (count)))
+
+#define DEALLOCATE(memory) \
+    std::free(memory)
+
+struct PathList {
+    char** paths;
+    int count;
+    int capacity;
+};
+
+static void add_path(PathList* list, const char* path) {
+    if (list->count == list->capacity) {
+        list->capacity = (list->capacity == 0) ? 64 : 2 * list->capacity;
+        list->paths = REALLOCATE(list->paths, char*, list->capacity);
+    }
+    std::size_t size = string_size(path) + 1;
+    char* copy = ALLOCATE(char, size);
+    copy_string(copy, path, size);
+    list->paths[list->count] = copy;
+    list->count += 1;
+}
+
+static void destroy_path_list(PathList* list) {
+    for (int i = 0; i < list->count; ++i) {
+        DEALLOCATE(list->paths[i]);
+    }
+    DEALLOCATE(list->paths);
+}
+
+// Hidden files, like editor swap files, are left out.
+static bool list_files(PathList* list, const char* directory) {
+    DIR* stream = opendir(directory);
+    if (!stream) {
+        LOG_ERROR("Couldn't open the directory %s.", directory);
+        return false;
+    }
+    bool listed = true;
+    while (struct dirent* entry = readdir(stream)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[256];
+        copy_string(path, directory, sizeof path);
+        append_string(path, "/", sizeof path);
+        append_string(path, entry->d_name, sizeof path);
+
+        struct stat status;
+        if (stat(path, &status) == -1) {
+            LOG_ERROR("Couldn't find out what %s is.", path);
+            listed = false;
+            break;
+        }
+        if (S_ISDIR(status.st_mode)) {
+            if (!list_files(list, path)) {
+                listed = false;
+                break;
+            }
+        } else if (S_ISREG(status.st_mode)) {
+            add_path(list, path);
+        }
+    }
+    closedir(stream);
+    return listed;
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return std::strcmp(*static_cast<char* const*>(a),
+                       *static_cast<char* const*>(b));
+}
+
+static std::size_t align(std::size_t offset) {
+    std::size_t mask = ASSET_PACK_ALIGNMENT - 1;
+    return (offset + mask) & ~mask;
+}
+
+static bool write_padding(std::FILE* file, std::size_t from, std::size_t to) {
+    static const char zeroes[ASSET_PACK_ALIGNMENT] = {};
+    std::size_t size = to - from;
+    return size == 0 || std::fwrite(zeroes, size, 1, file) == 1;
+}
+
+static bool write_pack(PathList* list, const char* filename) {
+    int count = list->count;
+    AssetPackEntry* entries = ALLOCATE(AssetPackEntry, count);
+
+    AssetPackHeader header;
+    header.magic = ASSET_PACK_MAGIC;
+    header.version = ASSET_PACK_VERSION;
+    header.entry_count = count;
+    header.paths_size = 0;
+    for (int i = 0; i < count; ++i) {
+        entries[i].path_offset = header.paths_size;
+        entries[i].path_size = string_size(list->paths[i]);
+        header.paths_size += entries[i].path_size + 1;
+    }
+
+    // Find where each file goes before writing anything, so the index can be
+    // written out in one go ahead of them.
+    std::size_t offset = sizeof header + sizeof(AssetPackEntry) * count +
+                         header.paths_size;
+    for (int i = 0; i < count; ++i) {
+        struct stat status;
+        if (stat(list->paths[i], &status) == -1) {
+            LOG_ERROR("Couldn't find out the size of %s.", list->paths[i]);
+            DEALLOCATE(entries);
+            return false;
+        }
+        offset = align(offset);
+        entries[i].offset = offset;
+        entries[i].size = status.st_size;
+        offset += status.st_size;
+    }
+
+    std::FILE* file = std::fopen(filename, "wb");
+    if (!file) {
+        DEALLOCATE(entries);
+        return false;
+    }
+
+    bool written =
+        std::fwrite(&header, sizeof header, 1, file) == 1 &&
+        (count == 0 ||
+         std::fwrite(entries, sizeof(AssetPackEntry) * count, 1, file) == 1);
+    for (int i = 0; i < count && written; ++i) {
+        written = std::fwrite(list->paths[i], entries[i].path_size + 1, 1,
+                              file) == 1;
+    }
+
+    offset = sizeof header + sizeof(AssetPackEntry) * count +
+             header.paths_size;
+    for (int i = 0; i < count && written; ++i) {
+        written = write_padding(file, offset, entries[i].offset);
+        offset = entries[i].offset;
+        if (!written || entries[i].size == 0) {
+            continue;
+        }
+        FileMapping mapping;
+        if (!map_file(&mapping, list->paths[i]) ||
+                mapping.size != entries[i].size) {
+            LOG_ERROR("Couldn't read %s, or it changed while being packed.",
+                      list->paths[i]);
+            unmap_file(&mapping);
+            written = false;
+            break;
+        }
+        written = std::fwrite(mapping.data, mapping.size, 1, file) == 1;
+        offset += mapping.size;
+        unmap_file(&mapping);
+    }
+
+    if (std::fclose(file) != 0) {
+        written = false;
+    }
+    DEALLOCATE(entries);
+    return written;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        LOG_ERROR("Usage: %s directory output.pack", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    PathList list = {};
+    if (!list_files(&list, argv[1])) {
+        destroy_path_list(&list);
+        return EXIT_FAILURE;
+    }
+    std::qsort(list.paths, list.count, sizeof *list.paths, compare_paths);
+
+    bool written = write_pack(&list, argv[2]);
+    destroy_path_list(&list);
+    if (!written) {
+        LOG_ERROR("Couldn't write the asset pack %s.", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include "atomic.h"
 #include "logging.h"
 #include "wave_decoder.h"
+#include "file_mapping.h"
+#include "asset_pack.h"
 #include "string_utilities.h"
 #include "monitoring.h"
 
@@ -13,11 +15,21 @@
 #include <alsa/asoundlib.h>
 
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
 
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // General-Use Macros and Functions............................................
 
 #define ALLOCATE_STRUCT(type) \
@@ -40,6 +52,153 @@
 
 namespace audio {
 
+// Mixer Reports...............................................................
+//     Once the mixer thread runs at real-time priority, it mustn't wait on
+//     anything the main thread might be holding. That rules out monitoring,
+//     whose chart is locked while it's drawn, and the log, which goes through
+//     stdio. So while mixing, the thread only adds to running totals and
+//     leaves messages in a queue, and publish_reports passes both on from the
+//     main thread.
+
+#define MAX_REPORTS 16
+#define MAX_REPORT_SIZE 192
+
+struct Report {
+    char text[MAX_REPORT_SIZE];
+    logging::Level level;
+};
+
+struct ReportQueue {
+    Report reports[MAX_REPORTS];
+    AtomicInt head;
+    AtomicInt tail;
+    AtomicInt dropped; // reports which didn't fit, ever
+    long dropped_logged; // only touched by the thread reading the queue
+};
+
+enum class MixerStage {
+    Decode,
+    Mix,
+    Output,
+    Decode_Ahead,
+};
+
+#define MIXER_STAGE_COUNT 4
+
+// Only the thread doing the mixing adds to these, and they're never reset, so
+// the main thread can tell what's changed since it last looked.
+struct MixerMonitor {
+    AtomicInt stage_time[MIXER_STAGE_COUNT]; // in nanoseconds
+    AtomicInt periods;
+    AtomicInt xruns;
+    AtomicInt wait_timeouts;
+    AtomicInt missed_deadlines;
+    AtomicInt period_changes;
+};
+
+namespace {
+    ReportQueue report_queue;
+    MixerMonitor mixer_monitor;
+    MixerMonitor published_monitor; // the totals as last passed on
+}
+
+static void add_to_total(AtomicInt* total, long amount) {
+    atomic_int_store(total, atomic_int_load(total) + amount);
+}
+
+static void add_report(logging::Level level, const char* format, ...) {
+    int current_tail = atomic_int_load(&report_queue.tail);
+    int next_tail = (current_tail + 1) % MAX_REPORTS;
+    if (next_tail == atomic_int_load(&report_queue.head)) {
+        add_to_total(&report_queue.dropped, 1);
+        return;
+    }
+    Report* report = report_queue.reports + current_tail;
+    va_list arguments;
+    va_start(arguments, format);
+    std::vsnprintf(report->text, sizeof report->text, format, arguments);
+    va_end(arguments);
+    report->level = level;
+    atomic_int_store(&report_queue.tail, next_tail);
+}
+
+#ifdef NDEBUG
+#define REPORT_DEBUG(format, ...) // do nothing
+#else
+#define REPORT_DEBUG(format, ...) add_report(logging::Level::Debug, (format), ##__VA_ARGS__)
+#endif
+
+#define REPORT_ERROR(format, ...) add_report(logging::Level::Error, (format), ##__VA_ARGS__)
+
+// Logs whatever's been reported, on whichever thread isn't mixing.
+static void log_reports() {
+    int current_head = atomic_int_load(&report_queue.head);
+    while (current_head != atomic_int_load(&report_queue.tail)) {
+        Report* report = report_queue.reports + current_head;
+        logging::add_message(report->level, "%s", report->text);
+        current_head = (current_head + 1) % MAX_REPORTS;
+        atomic_int_store(&report_queue.head, current_head);
+    }
+    long dropped = atomic_int_load(&report_queue.dropped);
+    if (dropped > report_queue.dropped_logged) {
+        LOG_ERROR("%li audio reports were dropped for lack of room.",
+                  dropped - report_queue.dropped_logged);
+        report_queue.dropped_logged = dropped;
+    }
+}
+
+// Memory Locking..............................................................
+//     When asked for, the buffers the mixer thread works with are locked into
+//     memory, so that it can't stall on a page fault partway through a
+//     period. Not being allowed to lock memory isn't fatal, it just stops
+//     any more being locked.
+
+namespace {
+    bool memory_locking;
+}
+
+static void lock_memory(const void* address, std::size_t bytes) {
+    if (memory_locking && mlock(address, bytes) != 0) {
+        REPORT_ERROR("Couldn't lock the mixer's memory, so it may be paged "
+                     "out.");
+        memory_locking = false;
+    }
+}
+
+// Neither freeing memory nor letting go of a view into the asset pack unlocks
+// it, so it's done here first, or the pages would stay locked for good and
+// count against the limit on locked memory. Unmapping a whole file does
+// unlock it. It's harmless to unlock memory which never was locked.
+static void unlock_memory(const void* address, std::size_t bytes) {
+    munlock(address, bytes);
+}
+
+// Buffers which might be locked are given whole pages to themselves. Locks
+// apply to whole pages and aren't counted, so otherwise unlocking one buffer
+// could unlock part of another which shares a page with it.
+static void* allocate_lockable(std::size_t bytes) {
+    std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t rounded = (bytes + page_size - 1) / page_size * page_size;
+    void* memory = nullptr;
+    if (posix_memalign(&memory, page_size, rounded) != 0) {
+        return nullptr;
+    }
+    return memory;
+}
+
+static void deallocate_lockable(void* memory, std::size_t bytes) {
+    if (memory) {
+        unlock_memory(memory, bytes);
+        std::free(memory);
+    }
+}
+
+#define ALLOCATE_LOCKABLE_ARRAY(type, count) \
+    static_cast<type*>(allocate_lockable(sizeof(type) * (count)))
+
+#define DEALLOCATE_LOCKABLE_ARRAY(a, type, count) \
+    deallocate_lockable((a), sizeof(type) * (count))
+
 // Formatting Functions........................................................
 
 enum Format {
@@ -420,6 +579,47 @@ static int set_buffer_size(snd_pcm_t* pcm_handle,
     return finalize_hw_params(pcm_handle, hw_params_copy, override, frames);
 }
 
+// Gives the device a buffer with room for two of the longest periods, split
+// into hardware periods no longer than the shortest one. The mixer can then be
+// woken for any period length in between just by changing when it's woken,
+// without stopping the device.
+static int set_adaptive_buffer_size(snd_pcm_t* pcm_handle,
+                                    snd_pcm_hw_params_t* hw_params,
+                                    u64 min_frames, u64 max_frames,
+                                    snd_pcm_uframes_t* buffer_frames) {
+    int status;
+
+    snd_pcm_hw_params_t* hw_params_copy;
+    snd_pcm_hw_params_alloca(&hw_params_copy);
+    snd_pcm_hw_params_copy(hw_params_copy, hw_params);
+
+    snd_pcm_uframes_t period_frames = min_frames;
+    status = snd_pcm_hw_params_set_period_size_near(pcm_handle, hw_params_copy,
+                                                    &period_frames, nullptr);
+    if (status < 0) {
+        return -1;
+    }
+
+    snd_pcm_uframes_t nearest_frames = 2 * max_frames;
+    status = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, hw_params_copy,
+                                                    &nearest_frames);
+    if (status < 0) {
+        return -1;
+    }
+
+    status = snd_pcm_hw_params(pcm_handle, hw_params_copy);
+    if (status < 0) {
+        return -1;
+    }
+
+    status = snd_pcm_hw_params_get_buffer_size(hw_params_copy, buffer_frames);
+    if (status < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 #define TEST_FORMAT_COUNT 5
 
 static Format test_formats[TEST_FORMAT_COUNT] = {
@@ -468,35 +668,54 @@ static void fill_remaining_specification(Specification* specification) {
                           specification->channels * specification->frames;
 }
 
-static bool open_device(const char* name, Specification* specification,
-                        snd_pcm_t** out_pcm_handle) {
-    int status;
+enum class TransferMode {
+    Write,         // samples are copied into the device with snd_pcm_writei
+    Memory_Mapped, // samples are converted straight into the device's buffer
+};
 
-    snd_pcm_t* pcm_handle;
-    status = snd_pcm_open(&pcm_handle, name, SND_PCM_STREAM_PLAYBACK,
-                          SND_PCM_NONBLOCK);
-    if (status < 0) {
-        LOG_ERROR("Couldn't open audio device \"%s\". %s", name,
-                  snd_strerror(status));
-        return false;
-    }
-    *out_pcm_handle = pcm_handle;
+// The mixer is woken once no more than a period is left queued, so that each
+// period written tops the buffer back up to two periods' worth.
+static snd_pcm_uframes_t get_wakeup_frames(snd_pcm_uframes_t buffer_frames,
+                                           u64 frames) {
+    return buffer_frames - frames;
+}
+
+// Negotiates the hardware and software parameters, asking for the period
+// size in the specification. If max_frames isn't zero, the buffer is sized so
+// the period can later change to anything from min_frames to max_frames, and
+// its size is handed back. Otherwise the period is fixed and the buffer size
+// handed back is zero.
+static bool configure_alsa_device(snd_pcm_t* pcm_handle,
+                                  Specification* specification,
+                                  u64 min_frames, u64 max_frames,
+                                  TransferMode* out_transfer_mode,
+                                  snd_pcm_uframes_t* out_buffer_frames) {
+    int status;
 
     snd_pcm_hw_params_t* hw_params;
     snd_pcm_hw_params_alloca(&hw_params);
     status = snd_pcm_hw_params_any(pcm_handle, hw_params);
     if (status < 0) {
-        LOG_ERROR("Couldn't get the hardware configuration. %s",
-                  snd_strerror(status));
+        REPORT_ERROR("Couldn't get the hardware configuration. %s",
+                     snd_strerror(status));
         return false;
     }
 
+    // Prefer having the device's buffer mapped in, so mixed samples can be
+    // converted directly into it, but not every device or plugin allows it.
     status = snd_pcm_hw_params_set_access(pcm_handle, hw_params,
-                                          SND_PCM_ACCESS_RW_INTERLEAVED);
+                                          SND_PCM_ACCESS_MMAP_INTERLEAVED);
     if (status < 0) {
-        LOG_ERROR("Couldn't set the hardware to interleaved access. %s",
-                  snd_strerror(status));
-        return false;
+        status = snd_pcm_hw_params_set_access(pcm_handle, hw_params,
+                                              SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (status < 0) {
+            REPORT_ERROR("Couldn't set the hardware to interleaved access. %s",
+                         snd_strerror(status));
+            return false;
+        }
+        *out_transfer_mode = TransferMode::Write;
+    } else {
+        *out_transfer_mode = TransferMode::Memory_Mapped;
     }
 
     Format test_format;
@@ -513,7 +732,7 @@ static bool open_device(const char* name, Specification* specification,
         }
     }
     if (status < 0) {
-        LOG_ERROR("Failed to obtain a suitable hardware audio format.");
+        REPORT_ERROR("Failed to obtain a suitable hardware audio format.");
         return false;
     }
     specification->format = test_format;
@@ -523,8 +742,8 @@ static bool open_device(const char* name, Specification* specification,
     if (status < 0) {
         status = snd_pcm_hw_params_get_channels(hw_params, &channels);
         if (status < 0) {
-            LOG_ERROR("Couldn't set the channel count. %s",
-                      snd_strerror(status));
+            REPORT_ERROR("Couldn't set the channel count. %s",
+                         snd_strerror(status));
             return false;
         }
         specification->channels = channels;
@@ -534,7 +753,7 @@ static bool open_device(const char* name, Specification* specification,
     status = snd_pcm_hw_params_set_rate_resample(pcm_handle, hw_params,
                                                  resample);
     if (status < 0) {
-        LOG_ERROR("Failed to enable resampling. %s", snd_strerror(status));
+        REPORT_ERROR("Failed to enable resampling. %s", snd_strerror(status));
         return false;
     }
 
@@ -542,49 +761,69 @@ static bool open_device(const char* name, Specification* specification,
     status = snd_pcm_hw_params_set_rate_near(pcm_handle, hw_params, &rate,
                                              nullptr);
     if (status < 0) {
-        LOG_ERROR("Couldn't set the sample rate. %s", snd_strerror(status));
+        REPORT_ERROR("Couldn't set the sample rate. %s", snd_strerror(status));
         return false;
     }
     if (rate != specification->sample_rate) {
-        LOG_ERROR("Couldn't obtain the desired sample rate for the device.");
+        REPORT_ERROR("Couldn't obtain the desired sample rate for the device.");
         return false;
     }
     specification->sample_rate = rate;
 
-    if (set_period_size(pcm_handle, hw_params, false, &specification->frames) < 0 &&
-        set_buffer_size(pcm_handle, hw_params, false, &specification->frames) < 0) {
+    snd_pcm_uframes_t buffer_frames = 0;
+    if (max_frames > 0 &&
+            set_adaptive_buffer_size(pcm_handle, hw_params, min_frames,
+                                     max_frames, &buffer_frames) < 0) {
+        REPORT_ERROR("Couldn't get a buffer big enough for the period size to "
+                     "change, so it will stay as it is.");
+        buffer_frames = 0;
+    }
+    if (buffer_frames > 0) {
+        if (specification->frames > buffer_frames / 2) {
+            specification->frames = buffer_frames / 2;
+        }
+    } else if (set_period_size(pcm_handle, hw_params, false, &specification->frames) < 0 &&
+               set_buffer_size(pcm_handle, hw_params, false, &specification->frames) < 0) {
         if (set_period_size(pcm_handle, hw_params, true, &specification->frames) < 0) {
-            LOG_ERROR("Couldn't set the desired period size and buffer size.");
+            REPORT_ERROR("Couldn't set the desired period size and buffer "
+                         "size.");
             return false;
         }
     }
+    *out_buffer_frames = buffer_frames;
+
+    snd_pcm_uframes_t wakeup_frames = specification->frames;
+    if (buffer_frames > 0) {
+        wakeup_frames = get_wakeup_frames(buffer_frames,
+                                          specification->frames);
+    }
 
     snd_pcm_sw_params_t* sw_params;
     snd_pcm_sw_params_alloca(&sw_params);
     status = snd_pcm_sw_params_current(pcm_handle, sw_params);
     if (status < 0) {
-        LOG_ERROR("Couldn't obtain the software configuration. %s",
-                  snd_strerror(status));
+        REPORT_ERROR("Couldn't obtain the software configuration. %s",
+                     snd_strerror(status));
         return false;
     }
 
     status = snd_pcm_sw_params_set_avail_min(pcm_handle, sw_params,
-                                             specification->frames);
+                                             wakeup_frames);
     if (status < 0) {
-        LOG_ERROR("Couldn't set the minimum available samples. %s",
-                  snd_strerror(status));
+        REPORT_ERROR("Couldn't set the minimum available samples. %s",
+                     snd_strerror(status));
         return false;
     }
     status = snd_pcm_sw_params_set_start_threshold(pcm_handle, sw_params, 1);
     if (status < 0) {
-        LOG_ERROR("Couldn't set the start threshold. %s",
-                  snd_strerror(status));
+        REPORT_ERROR("Couldn't set the start threshold. %s",
+                     snd_strerror(status));
         return false;
     }
     status = snd_pcm_sw_params(pcm_handle, sw_params);
     if (status < 0) {
-        LOG_ERROR("Couldn't set software audio parameters. %s",
-                  snd_strerror(status));
+        REPORT_ERROR("Couldn't set software audio parameters. %s",
+                     snd_strerror(status));
         return false;
     }
 
@@ -593,319 +832,2530 @@ static bool open_device(const char* name, Specification* specification,
     return true;
 }
 
-static void close_device(snd_pcm_t* pcm_handle) {
-    if (pcm_handle) {
-        snd_pcm_drain(pcm_handle);
+static bool open_alsa_device(const char* name, Specification* specification,
+                             u64 min_frames, u64 max_frames,
+                             snd_pcm_t** out_pcm_handle,
+                             TransferMode* out_transfer_mode,
+                             snd_pcm_uframes_t* out_buffer_frames) {
+    snd_pcm_t* pcm_handle;
+    int status = snd_pcm_open(&pcm_handle, name, SND_PCM_STREAM_PLAYBACK,
+                              SND_PCM_NONBLOCK);
+    if (status < 0) {
+        REPORT_ERROR("Couldn't open audio device \"%s\". %s", name,
+                     snd_strerror(status));
+        return false;
+    }
+
+    // Nothing's been played yet, so a device which can't be configured is
+    // just closed, rather than left for the caller to clean up.
+    if (!configure_alsa_device(pcm_handle, specification, min_frames,
+                               max_frames, out_transfer_mode,
+                               out_buffer_frames)) {
         snd_pcm_close(pcm_handle);
+        return false;
     }
+    *out_pcm_handle = pcm_handle;
+
+    return true;
 }
 
-// Stream functions............................................................
-//     for streaming audio from file sources, right now Vorbis from .ogg files
-//     and PCM and ADPCM inside .wav files
+// Changes the period of a device whose buffer was sized for it to change.
+// Only when the mixer is woken changes, so the device carries on playing
+// whatever's queued and nothing is dropped or drained. A shorter period waits
+// for the queue to run down to it, and a longer one is written sooner.
+static bool set_alsa_period(snd_pcm_t* pcm_handle,
+                            snd_pcm_uframes_t buffer_frames, u64 frames) {
+    snd_pcm_sw_params_t* sw_params;
+    snd_pcm_sw_params_alloca(&sw_params);
+    if (snd_pcm_sw_params_current(pcm_handle, sw_params) < 0) {
+        return false;
+    }
+    snd_pcm_uframes_t wakeup_frames = get_wakeup_frames(buffer_frames, frames);
+    if (snd_pcm_sw_params_set_avail_min(pcm_handle, sw_params,
+                                        wakeup_frames) < 0) {
+        return false;
+    }
+    return snd_pcm_sw_params(pcm_handle, sw_params) >= 0;
+}
 
-struct Stream {
-    enum class DecoderType {
-        Vorbis,
-        Wave,
-    } decoder_type;
+// Copies a period of already-converted samples into the device, and returns
+// how many underruns had to be recovered from along the way.
+static int write_period(snd_pcm_t* pcm_handle, void* samples,
+                        snd_pcm_uframes_t frames, int frame_size) {
+    int xruns = 0;
+    u8* buffer = static_cast<u8*>(samples);
+    snd_pcm_uframes_t frames_left = frames;
+    while (frames_left > 0) {
+        int frames_written = snd_pcm_writei(pcm_handle, buffer, frames_left);
+        if (frames_written < 0) {
+            int status = frames_written;
+            if (status == -EAGAIN) {
+                continue;
+            }
+            if (status == -EPIPE) {
+                xruns += 1;
+            }
+            status = snd_pcm_recover(pcm_handle, status, 0);
+            if (status < 0) {
+                break;
+            }
+            continue;
+        }
+        buffer += frames_written * frame_size;
+        frames_left -= frames_written;
+    }
+    return xruns;
+}
 
-    union {
-        struct {
-            stb_vorbis* decoder;
-        } vorbis;
-        struct {
-            WaveDecoder* decoder;
-        } wave;
-    };
+// Converts a period of mixed samples directly into the device's own ring
+// buffer, which saves both the intermediate copy and the system call that
+// snd_pcm_writei would make. Like write_period, it returns how many
+// underruns it recovered from.
+static int transfer_period_mapped(snd_pcm_t* pcm_handle, float* samples,
+                                  snd_pcm_uframes_t frames,
+                                  ConversionInfo* conversion_info) {
+    int xruns = 0;
+    int channels = conversion_info->channels;
+    snd_pcm_uframes_t frames_left = frames;
+    while (frames_left > 0) {
+        snd_pcm_sframes_t available = snd_pcm_avail_update(pcm_handle);
+        if (available < 0) {
+            if (available == -EPIPE) {
+                xruns += 1;
+            }
+            int status = snd_pcm_recover(pcm_handle, available, 0);
+            if (status < 0) {
+                break;
+            }
+            continue;
+        }
+        if (available == 0) {
+            // The ring is full. If the device hasn't been started yet it
+            // never will be by waiting, so kick it off.
+            if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED) {
+                snd_pcm_start(pcm_handle);
+            } else {
+                snd_pcm_wait(pcm_handle, 150);
+            }
+            continue;
+        }
 
-    int channels;
-    float* decoded_samples;
-    float volume;
-    bool looping;
-    StreamId id;
-};
+        // The area handed back is contiguous, so it may be shorter than
+        // asked for when it runs up against the end of the ring.
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t contiguous = frames_left;
+        int status = snd_pcm_mmap_begin(pcm_handle, &areas, &offset,
+                                        &contiguous);
+        if (status < 0) {
+            if (status == -EPIPE) {
+                xruns += 1;
+            }
+            status = snd_pcm_recover(pcm_handle, status, 0);
+            if (status < 0) {
+                break;
+            }
+            continue;
+        }
 
-static Stream::DecoderType decoder_type_from_file_extension(const char* extension) {
-         if (strings_match(extension, "wav")) return Stream::DecoderType::Wave;
-    else if (strings_match(extension, "ogg")) return Stream::DecoderType::Vorbis;
-    return Stream::DecoderType::Wave;
+        u8* destination = static_cast<u8*>(areas[0].addr) +
+                          (areas[0].first + offset * areas[0].step) / 8;
+        float* source = samples + (frames - frames_left) * channels;
+        convert_format(source, destination, contiguous, conversion_info);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm_handle, offset,
+                                                          contiguous);
+        if (committed < 0 ||
+            static_cast<snd_pcm_uframes_t>(committed) != contiguous) {
+            xruns += 1;
+            status = snd_pcm_recover(pcm_handle,
+                                     (committed < 0) ? committed : -EPIPE, 0);
+            if (status < 0) {
+                break;
+            }
+            continue;
+        }
+        frames_left -= contiguous;
+    }
+
+    // Unlike with snd_pcm_writei, committing doesn't start the device by
+    // itself.
+    if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED) {
+        snd_pcm_start(pcm_handle);
+    }
+
+    return xruns;
 }
 
-static void fill_with_silence(float* samples, u8 silence, u64 count) {
-    std::memset(samples, silence, sizeof(float) * count);
+static void close_alsa_device(snd_pcm_t* pcm_handle) {
+    if (pcm_handle) {
+        snd_pcm_drain(pcm_handle);
+        snd_pcm_close(pcm_handle);
+    }
 }
 
-#define MAX_STREAMS 16
+// Null device back-end........................................................
+//     for running the mixer without any sound hardware, either paced the way
+//     a real device would pace it or as fast as it can go
 
-struct StreamManager {
-    Stream streams[MAX_STREAMS];
-    int stream_count;
+struct NullDevice {
+    timespec deadline;
+    bool throttled;
 };
 
-static int close_stream(StreamManager* manager, int stream_index) {
-    assert(stream_index >= 0 && stream_index < manager->stream_count);
+static void open_null_device(NullDevice* device, bool throttled) {
+    device->throttled = throttled;
+    clock_gettime(CLOCK_MONOTONIC, &device->deadline);
+}
 
-    Stream* stream = manager->streams + stream_index;
-    switch (stream->decoder_type) {
-        case Stream::DecoderType::Vorbis: {
-            stb_vorbis_close(stream->vorbis.decoder);
-            break;
-        }
-        case Stream::DecoderType::Wave: {
-            wave_close_file(stream->wave.decoder);
-            break;
-        }
+static void wait_for_null_device(NullDevice* device,
+                                 Specification* specification) {
+    if (!device->throttled) {
+        return;
     }
-    DEALLOCATE_ARRAY(stream->decoded_samples);
 
-    int last = manager->stream_count - 1;
-    if (manager->stream_count > 1 && stream_index != last) {
-        manager->streams[stream_index] = manager->streams[last];
+    // Sleep until the time the period would've finished playing, measured
+    // from an absolute deadline so that oversleeping doesn't accumulate.
+    const long nanoseconds_per_second = 1000000000;
+    long period = (nanoseconds_per_second * specification->frames) /
+                  specification->sample_rate;
+    device->deadline.tv_nsec += period;
+    while (device->deadline.tv_nsec >= nanoseconds_per_second) {
+        device->deadline.tv_nsec -= nanoseconds_per_second;
+        device->deadline.tv_sec += 1;
     }
-    manager->stream_count -= 1;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &device->deadline,
+                    nullptr);
+}
 
-    return stream_index - 1;
+// Wave file device back-end...................................................
+//     for capturing the mixer's output to a file
+
+struct WaveFileDevice {
+    std::FILE* file;
+    u64 frames_written;
+    bool full;
+};
+
+static void put_u16(u8* buffer, u16 x) {
+    buffer[0] = x;
+    buffer[1] = x >> 8;
 }
 
-static void close_stream_by_id(StreamManager* manager, StreamId stream_id) {
-    FOR_N(i, manager->stream_count) {
-        Stream* stream = manager->streams + i;
-        if (stream->id == stream_id) {
-            i = close_stream(manager, i);
-        }
-    }
+static void put_u32(u8* buffer, u32 x) {
+    buffer[0] = x;
+    buffer[1] = x >> 8;
+    buffer[2] = x >> 16;
+    buffer[3] = x >> 24;
 }
 
-static void close_all_streams(StreamManager* stream_manager) {
-    FOR_N(i, stream_manager->stream_count) {
-        close_stream(stream_manager, i);
-    }
+// The largest header written, which is the one for floating-point formats.
+#define MAX_WAVE_HEADER_SIZE 58
+
+// Every size in a wave file is 32 bits, the RIFF chunk's included, so this is
+// as many frames as a file can hold with its header still right.
+static u64 max_wave_file_frames(Specification* specification) {
+    u64 block_alignment = format_byte_count(specification->format) *
+                          specification->channels;
+    return (0xFFFFFFFF - MAX_WAVE_HEADER_SIZE) / block_alignment;
 }
 
-static void open_stream(StreamManager* stream_manager, const char* filename,
-                        u64 samples_to_decode, float volume, bool looping,
-                        StreamId id = 0) {
+static void write_wave_header(std::FILE* file, Specification* specification,
+                              u64 frames) {
+    const u16 WAVE_FORMAT_PCM = 0x0001;
+    const u16 WAVE_FORMAT_IEEE_FLOAT = 0x0003;
 
-    Stream* stream = stream_manager->streams + stream_manager->stream_count;
+    u64 max_frames = max_wave_file_frames(specification);
+    if (frames > max_frames) {
+        frames = max_frames;
+    }
 
-    const char* file_extension = std::strstr(filename, ".") + 1;
-    stream->decoder_type = decoder_type_from_file_extension(file_extension);
+    bool is_float = specification->format == FORMAT_F32 ||
+                    specification->format == FORMAT_F64;
+    u16 bytes_per_sample = format_byte_count(specification->format);
+    u16 block_alignment = bytes_per_sample * specification->channels;
+    u32 data_size = block_alignment * frames;
+
+    // Floating-point formats need the extended format chunk and a fact
+    // chunk, where integer PCM only needs the basic format chunk.
+    u32 format_size = (is_float) ? 18 : 16;
+    u32 fact_size = (is_float) ? 12 : 0;
+
+    u8 header[MAX_WAVE_HEADER_SIZE];
+    u8* at = header;
+    std::memcpy(at, "RIFF", 4);
+    put_u32(at + 4, 4 + (8 + format_size) + fact_size + (8 + data_size));
+    std::memcpy(at + 8, "WAVE", 4);
+    at += 12;
+
+    std::memcpy(at, "fmt ", 4);
+    put_u32(at + 4, format_size);
+    put_u16(at + 8, (is_float) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+    put_u16(at + 10, specification->channels);
+    put_u32(at + 12, specification->sample_rate);
+    put_u32(at + 16, specification->sample_rate * block_alignment);
+    put_u16(at + 20, block_alignment);
+    put_u16(at + 22, 8 * bytes_per_sample);
+    at += 24;
+    if (is_float) {
+        put_u16(at, 0); // extension size
+        at += 2;
+
+        std::memcpy(at, "fact", 4);
+        put_u32(at + 4, 4);
+        put_u32(at + 8, frames);
+        at += 12;
+    }
 
-    char path[256];
-    copy_string(path, "Assets/", sizeof path);
-    append_string(path, filename, sizeof path);
+    std::memcpy(at, "data", 4);
+    put_u32(at + 4, data_size);
+    at += 8;
 
-    switch (stream->decoder_type) {
-        case Stream::DecoderType::Vorbis: {
-            stb_vorbis* decoder;
-            int open_error = 0;
-            decoder = stb_vorbis_open_filename(path, &open_error, nullptr);
-            if (!decoder || open_error) {
-                LOG_ERROR("Vorbis file %s failed to load: %i", path,
-                          open_error);
-            }
-            stream->vorbis.decoder = decoder;
+    std::fwrite(header, 1, at - header, file);
+}
 
-            stb_vorbis_info info = stb_vorbis_get_info(stream->vorbis.decoder);
-            stream->channels = info.channels;
+static bool open_wave_file_device(WaveFileDevice* device, const char* filename,
+                                  Specification* specification) {
+    // Only the formats that can be written to a wave file as-is are kept.
+    switch (specification->format) {
+        case FORMAT_S16:
+        case FORMAT_S32:
+        case FORMAT_F32:
+        case FORMAT_F64:
             break;
-        }
-        case Stream::DecoderType::Wave: {
-            WaveDecoder* decoder;
-            decoder = wave_open_file(path);
-            if (!decoder) {
-                LOG_ERROR("Wave file %s failed to load.", path);
-            }
-            stream->wave.decoder = decoder;
-            stream->channels = wave_channels(decoder);
+        default:
+            specification->format = FORMAT_S16;
             break;
-        }
     }
+    fill_remaining_specification(specification);
 
-    stream->decoded_samples = ALLOCATE_ARRAY(float, samples_to_decode);
-    stream->volume = volume;
-    stream->looping = looping;
-    stream->id = id;
-    stream_manager->stream_count += 1;
+    device->file = std::fopen(filename, "wb");
+    if (!device->file) {
+        REPORT_ERROR("Couldn't open the file \"%s\" for audio output.",
+                     filename);
+        return false;
+    }
+    device->frames_written = 0;
+    device->full = false;
+
+    // Write the header as a placeholder to fill in once the final length
+    // is known.
+    write_wave_header(device->file, specification, 0);
+
+    return true;
 }
 
-static void decode_streams(StreamManager* stream_manager, int frames) {
-    FOR_N(i, stream_manager->stream_count) {
-        Stream* stream = stream_manager->streams + i;
-        int channels = stream->channels;
-        int samples_to_decode = channels * frames;
-        switch (stream->decoder_type) {
-            case Stream::DecoderType::Vorbis: {
-                int frames_decoded = stb_vorbis_get_samples_float_interleaved(stream->vorbis.decoder, channels, stream->decoded_samples, samples_to_decode);
-                if (frames_decoded < frames) {
-                    if (stream->looping) {
-                        samples_to_decode -= frames_decoded * channels;
-                        stb_vorbis_seek_start(stream->vorbis.decoder);
-                        stb_vorbis_get_samples_float_interleaved(stream->vorbis.decoder, channels, stream->decoded_samples, samples_to_decode);
-                    } else {
-                        int samples_needed = (frames - frames_decoded) * channels;
-                        fill_with_silence(stream->decoded_samples, 0, samples_needed);
-                        i = close_stream(stream_manager, i);
-                    }
-                }
-                break;
-            }
-            case Stream::DecoderType::Wave: {
-                int frames_decoded = wave_decode_interleaved(stream->wave.decoder, channels, stream->decoded_samples, samples_to_decode);
-                if (frames_decoded < frames) {
-                    if (stream->looping) {
-                        samples_to_decode -= frames_decoded * channels;
-                        wave_seek_start(stream->wave.decoder);
-                        wave_decode_interleaved(stream->wave.decoder, channels, stream->decoded_samples, samples_to_decode);
-                    } else {
-                        int samples_needed = (frames - frames_decoded) * channels;
-                        fill_with_silence(stream->decoded_samples, 0, samples_needed);
-                        i = close_stream(stream_manager, i);
-                    }
-                }
-                break;
-            }
+// Once the file's as long as it can be, anything more is dropped, so that
+// what's been captured so far is still a valid file.
+static void write_to_wave_file_device(WaveFileDevice* device, void* samples,
+                                      Specification* specification) {
+    if (!device->file) {
+        return;
+    }
+    u64 frames = specification->frames;
+    u64 room = max_wave_file_frames(specification) - device->frames_written;
+    if (frames > room) {
+        frames = room;
+        if (!device->full) {
+            REPORT_ERROR("The audio output file is full at 4 GiB, so the rest "
+                         "won't be captured.");
+            device->full = true;
         }
     }
+    u64 frame_size = format_byte_count(specification->format) *
+                     specification->channels;
+    std::fwrite(samples, 1, frame_size * frames, device->file);
+    device->frames_written += frames;
 }
 
-static float clamp(float x, float min, float max) {
-    return (x < min) ? min : (x > max) ? max : x;
+static void close_wave_file_device(WaveFileDevice* device,
+                                   Specification* specification) {
+    if (device->file) {
+        std::fseek(device->file, 0, SEEK_SET);
+        write_wave_header(device->file, specification,
+                          device->frames_written);
+        std::fclose(device->file);
+    }
 }
 
-static void mix_streams(StreamManager* stream_manager, float* mix_buffer,
-                        int frames, int channels) {
-    int samples = frames * channels;
+// Device Functions............................................................
+//     which pass each period of mixed samples on to whichever back-end was
+//     chosen at startup
 
-    // Mix the streams' samples into the given buffer.
-    FOR_N(i, stream_manager->stream_count) {
-        Stream* stream = stream_manager->streams + i;
-        if (channels < stream->channels) {
-            FOR_N(j, frames) {
-                FOR_N(k, channels) {
-                    mix_buffer[j*channels+k] += stream->volume * stream->decoded_samples[j*stream->channels];
-                }
+struct Device {
+    Backend backend;
+    u64 xruns;
+    u64 wait_timeouts;
+    union {
+        struct {
+            snd_pcm_t* pcm_handle;
+            TransferMode transfer_mode;
+            snd_pcm_uframes_t buffer_frames; // or 0 if the period is fixed
+        } alsa;
+        NullDevice null;
+        WaveFileDevice wave_file;
+    };
+};
+
+// The period can only change between min_frames and max_frames afterwards,
+// and not at all if they're zero.
+static bool open_device(Device* device, Backend backend,
+                        const char* output_filename,
+                        Specification* specification, u64 min_frames,
+                        u64 max_frames) {
+    device->backend = backend;
+    device->xruns = 0;
+    device->wait_timeouts = 0;
+    switch (backend) {
+        case Backend::Alsa: {
+            device->alsa.pcm_handle = nullptr;
+            return open_alsa_device("default", specification, min_frames,
+                                    max_frames, &device->alsa.pcm_handle,
+                                    &device->alsa.transfer_mode,
+                                    &device->alsa.buffer_frames);
+        }
+        case Backend::Null:
+        case Backend::Null_Unthrottled: {
+            open_null_device(&device->null, backend == Backend::Null);
+            return true;
+        }
+        case Backend::Wave_File: {
+            return open_wave_file_device(&device->wave_file, output_filename,
+                                         specification);
+        }
+    }
+    return false;
+}
+
+static void close_device(Device* device, Specification* specification) {
+    switch (device->backend) {
+        case Backend::Alsa: {
+            close_alsa_device(device->alsa.pcm_handle);
+            break;
+        }
+        case Backend::Null:
+        case Backend::Null_Unthrottled: {
+            break;
+        }
+        case Backend::Wave_File: {
+            close_wave_file_device(&device->wave_file, specification);
+            break;
+        }
+    }
+}
+
+// Whether mixed samples have to be converted into a separate buffer before
+// being handed over, as opposed to straight into memory owned by the device.
+static bool needs_devicebound_buffer(Device* device) {
+    return !(device->backend == Backend::Alsa &&
+             device->alsa.transfer_mode == TransferMode::Memory_Mapped);
+}
+
+// Changes how many frames go in each period. Anything beyond max_frames
+// wouldn't fit the buffers which were set up for the device, and a real
+// device can only go up to half its buffer, so in either case the period
+// stays as it is.
+static bool resize_device_period(Device* device, Specification* specification,
+                                 u64 frames, u64 max_frames) {
+    if (frames > max_frames) {
+        return false;
+    }
+    switch (device->backend) {
+        case Backend::Alsa: {
+            snd_pcm_uframes_t buffer_frames = device->alsa.buffer_frames;
+            if (frames > buffer_frames / 2 ||
+                    !set_alsa_period(device->alsa.pcm_handle, buffer_frames,
+                                     frames)) {
+                return false;
+            }
+            specification->frames = frames;
+            fill_remaining_specification(specification);
+            return true;
+        }
+        case Backend::Null:
+        case Backend::Null_Unthrottled:
+        case Backend::Wave_File: {
+            specification->frames = frames;
+            fill_remaining_specification(specification);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Blocks until the device is ready to take another period.
+static void wait_for_device(Device* device, Specification* specification) {
+    switch (device->backend) {
+        case Backend::Alsa: {
+            int stream_ready = snd_pcm_wait(device->alsa.pcm_handle, 150);
+            if (!stream_ready) {
+                REPORT_ERROR("ALSA device waiting timed out!");
+                device->wait_timeouts += 1;
+                add_to_total(&mixer_monitor.wait_timeouts, 1);
             }
-        } else if (channels > stream->channels) {
-            assert(stream->channels == 1); // @Incomplete: This path doesn't actually handle stereo-to-surround mixing
-            FOR_N(j, frames) {
-                float sample = stream->volume * stream->decoded_samples[j*stream->channels];
-                FOR_N(k, channels) {
-                    mix_buffer[j*channels+k] += sample;
+            break;
+        }
+        case Backend::Null:
+        case Backend::Null_Unthrottled: {
+            wait_for_null_device(&device->null, specification);
+            break;
+        }
+        case Backend::Wave_File: {
+            break;
+        }
+    }
+}
+
+// Converts a period of mixed samples to the device's format and hands them
+// over.
+static void transfer_period(Device* device, float* mixed_samples,
+                            void* devicebound_samples,
+                            Specification* specification,
+                            ConversionInfo* conversion_info) {
+    if (needs_devicebound_buffer(device)) {
+        convert_format(mixed_samples, devicebound_samples,
+                       specification->frames, conversion_info);
+    }
+
+    switch (device->backend) {
+        case Backend::Alsa: {
+            snd_pcm_t* pcm_handle = device->alsa.pcm_handle;
+            int xruns = 0;
+            switch (device->alsa.transfer_mode) {
+                case TransferMode::Write: {
+                    int frame_size = conversion_info->channels *
+                                     format_byte_count(specification->format);
+                    xruns = write_period(pcm_handle, devicebound_samples,
+                                         specification->frames, frame_size);
+                    break;
+                }
+                case TransferMode::Memory_Mapped: {
+                    xruns = transfer_period_mapped(pcm_handle, mixed_samples,
+                                                   specification->frames,
+                                                   conversion_info);
+                    break;
                 }
             }
+            device->xruns += xruns;
+            add_to_total(&mixer_monitor.xruns, xruns);
+            break;
+        }
+        case Backend::Null:
+        case Backend::Null_Unthrottled: {
+            break;
+        }
+        case Backend::Wave_File: {
+            write_to_wave_file_device(&device->wave_file, devicebound_samples,
+                                      specification);
+            break;
+        }
+    }
+}
+
+// Asset Cache.................................................................
+//     Keeps track of how often each file is played, and uses that along with
+//     its size to decide how to hold on to it:
+//
+//     streamed   - decoded from the file as it plays, using no memory
+//     compressed - the file is held in memory and decoded from there
+//     decoded    - every frame is held in memory, so playing it costs nothing
+//
+//     Files are decoded straight out of a mapping of them, which is shared by
+//     every stream playing the same asset at once, and dropped when the last
+//     one finishes. Holding a file compressed just means keeping its mapping
+//     and having the whole of it paged in.
+//
+//     Rather than decoding a whole file in one go on the mixer thread, the
+//     frames for the decoded tier are captured from a stream of it as that
+//     plays through from start to finish. Everything held counts against a
+//     fixed budget, and the assets used least recently are dropped back to
+//     streaming when room is needed for something else.
+
+#define MAX_CACHED_ASSETS 32
+#define ASSET_CACHE_BUDGET (32 * 1024 * 1024) // in bytes
+#define SMALL_ASSET_SIZE (256 * 1024) // files this size and under are always held
+#define HOT_ASSET_PLAYS 3 // plays after which the asset is held decoded
+
+struct AudioAsset {
+    char path[256];
+    FileMapping mapping; // the whole file, while it's being read or held
+    float* samples; // the decoded frames, if held decoded
+    std::size_t file_size;
+    u64 last_used;
+    u32 frame_count;
+    u32 frames_captured;
+    u32 frames_allocated; // room in samples, which can be more than captured
+    int channels;
+    int plays;
+    int users; // how many streams are reading from the asset
+    bool held; // the mapping is kept between plays and counts as memory used
+    bool capturing;
+    bool decoded; // all the frames have been captured
+};
+
+struct AssetCache {
+    AudioAsset assets[MAX_CACHED_ASSETS];
+    int asset_count;
+    std::size_t bytes_used;
+    u64 tick;
+};
+
+static std::size_t decoded_size(AudioAsset* asset) {
+    return sizeof(float) * asset->channels * asset->frame_count;
+}
+
+// The memory actually held for the decoded frames, which is what's freed and
+// counted against the budget.
+static std::size_t samples_size(AudioAsset* asset) {
+    return sizeof(float) * asset->channels * asset->frames_allocated;
+}
+
+static void release_asset(AssetCache* cache, AudioAsset* asset) {
+    if (asset->held) {
+        asset->held = false;
+        cache->bytes_used -= asset->file_size;
+        if (!asset->mapping.owned) {
+            unlock_memory(asset->mapping.data, asset->file_size);
+        }
+    }
+    if (asset->users == 0) {
+        unmap_file(&asset->mapping);
+    }
+    if (asset->samples) {
+        DEALLOCATE_LOCKABLE_ARRAY(asset->samples, float,
+                                  asset->channels * asset->frames_allocated);
+        asset->samples = nullptr;
+        cache->bytes_used -= samples_size(asset);
+        asset->frames_allocated = 0;
+    }
+    asset->capturing = false;
+    asset->decoded = false;
+}
+
+static AudioAsset* find_least_recently_used(AssetCache* cache,
+                                            bool only_holding_memory) {
+    AudioAsset* found = nullptr;
+    FOR_N(i, cache->asset_count) {
+        AudioAsset* asset = cache->assets + i;
+        if (asset->users > 0) {
+            continue;
+        }
+        if (only_holding_memory && !asset->held && !asset->samples) {
+            continue;
+        }
+        if (!found || asset->last_used < found->last_used) {
+            found = asset;
+        }
+    }
+    return found;
+}
+
+static bool make_room(AssetCache* cache, std::size_t bytes) {
+    if (bytes > ASSET_CACHE_BUDGET) {
+        return false;
+    }
+    while (cache->bytes_used + bytes > ASSET_CACHE_BUDGET) {
+        AudioAsset* asset = find_least_recently_used(cache, true);
+        if (!asset) {
+            return false;
+        }
+        release_asset(cache, asset);
+    }
+    return true;
+}
+
+static AudioAsset* find_asset(AssetCache* cache, const char* path) {
+    AudioAsset* asset = nullptr;
+    FOR_N(i, cache->asset_count) {
+        if (strings_match(cache->assets[i].path, path)) {
+            asset = cache->assets + i;
+            break;
+        }
+    }
+
+    if (!asset) {
+        if (cache->asset_count < MAX_CACHED_ASSETS) {
+            asset = cache->assets + cache->asset_count;
+            cache->asset_count += 1;
         } else {
-            FOR_N(j, samples) {
-                mix_buffer[j] += stream->volume * stream->decoded_samples[j];
+            // Forget about whichever asset was used longest ago.
+            asset = find_least_recently_used(cache, false);
+            if (!asset) {
+                return nullptr;
+            }
+            release_asset(cache, asset);
+        }
+        CLEAR_STRUCT(asset);
+        copy_string(asset->path, path, sizeof asset->path);
+    }
+
+    cache->tick += 1;
+    asset->last_used = cache->tick;
+    asset->plays += 1;
+
+    return asset;
+}
+
+static bool should_hold_compressed(AudioAsset* asset) {
+    return asset->file_size > 0 &&
+           asset->file_size <= ASSET_CACHE_BUDGET / 4 &&
+           (asset->file_size <= SMALL_ASSET_SIZE || asset->plays >= 2);
+}
+
+static bool should_hold_decoded(AudioAsset* asset) {
+    // The frame count isn't known until the file's been opened once.
+    return asset->frame_count > 0 &&
+           decoded_size(asset) <= ASSET_CACHE_BUDGET / 4 &&
+           (asset->file_size <= SMALL_ASSET_SIZE ||
+            asset->plays >= HOT_ASSET_PLAYS);
+}
+
+// Maps the file in for a stream to read from, unless it already is.
+static bool map_asset(AudioAsset* asset) {
+    if (asset->mapping.data) {
+        return true;
+    }
+    if (!find_packed_file(&asset->mapping, asset->path) &&
+            !map_file(&asset->mapping, asset->path)) {
+        return false;
+    }
+    asset->file_size = asset->mapping.size;
+    advise_mapping(&asset->mapping, MappingAccess::Sequential);
+    return true;
+}
+
+// Called when a stream stops reading from the asset.
+static void stop_using_asset(AudioAsset* asset) {
+    asset->users -= 1;
+    if (asset->users == 0 && !asset->held) {
+        unmap_file(&asset->mapping);
+    }
+}
+
+static void hold_asset(AssetCache* cache, AudioAsset* asset) {
+    if (!make_room(cache, asset->file_size)) {
+        return;
+    }
+    advise_mapping(&asset->mapping, MappingAccess::Soon);
+    lock_memory(asset->mapping.data, asset->file_size);
+    asset->held = true;
+    cache->bytes_used += asset->file_size;
+}
+
+static bool begin_capture(AssetCache* cache, AudioAsset* asset) {
+    std::size_t bytes = decoded_size(asset);
+    if (!make_room(cache, bytes)) {
+        return false;
+    }
+    asset->samples = ALLOCATE_LOCKABLE_ARRAY(float, asset->channels * asset->frame_count);
+    if (!asset->samples) {
+        return false;
+    }
+    lock_memory(asset->samples, bytes);
+    cache->bytes_used += bytes;
+    asset->frames_allocated = asset->frame_count;
+    asset->frames_captured = 0;
+    asset->capturing = true;
+    return true;
+}
+
+static void cancel_capture(AssetCache* cache, AudioAsset* asset) {
+    DEALLOCATE_LOCKABLE_ARRAY(asset->samples, float,
+                              asset->channels * asset->frames_allocated);
+    asset->samples = nullptr;
+    cache->bytes_used -= samples_size(asset);
+    asset->frames_allocated = 0;
+    asset->capturing = false;
+}
+
+// Copies frames from a stream as it decodes them, so long as they carry on
+// from the ones captured already.
+static void capture_frames(AssetCache* cache, AudioAsset* asset,
+                           u64 position, const float* samples, int frames) {
+    if (position != asset->frames_captured) {
+        cancel_capture(cache, asset);
+        return;
+    }
+    u32 frames_left = asset->frames_allocated - asset->frames_captured;
+    if (static_cast<u32>(frames) > frames_left) {
+        frames = frames_left;
+    }
+    int channels = asset->channels;
+    std::memcpy(asset->samples + asset->frames_captured * channels, samples,
+                sizeof(float) * channels * frames);
+    asset->frames_captured += frames;
+}
+
+static void finish_capture(AssetCache* cache, AudioAsset* asset) {
+    if (asset->frames_captured == 0) {
+        cancel_capture(cache, asset);
+        return;
+    }
+    // The length given up front is only an estimate for some files, so go
+    // by how many frames actually came out. Any room left over stays
+    // allocated, and counted, until the frames are let go.
+    asset->frame_count = asset->frames_captured;
+    asset->capturing = false;
+    asset->decoded = true;
+}
+
+static void destroy_asset_cache(AssetCache* cache) {
+    FOR_N(i, cache->asset_count) {
+        release_asset(cache, cache->assets + i);
+    }
+    cache->asset_count = 0;
+}
+
+// Stream functions............................................................
+//     for streaming audio from file sources, right now Vorbis from .ogg files
+//     and PCM and ADPCM inside .wav files
+
+// Volume changes are ramped across frames rather than jumped to, starting
+// some number of frames into a period.
+struct VolumeRamp {
+    float target;
+    float step; // added to, or multiplied by, the volume each frame
+    int delay;
+    int frames;
+    Fade fade;
+    bool started;
+};
+
+struct Stream {
+    enum class DecoderType {
+        Vorbis,
+        Wave,
+        Decoded, // frames held in the asset cache
+    } decoder_type;
+
+    union {
+        struct {
+            stb_vorbis* decoder;
+        } vorbis;
+        struct {
+            WaveDecoder* decoder;
+        } wave;
+    };
+
+    AudioAsset* asset;
+    bool capturing; // the frames being decoded are copied into the asset
+
+    int channels;
+    float* decoded_samples;
+    int decoded_capacity; // in frames
+
+    // Frames decoded ahead of when they're needed, held in a ring.
+    struct {
+        float* samples;
+        int capacity; // in frames
+        int start;
+        int count;
+    } ahead;
+
+    u64 position; // the frame the decoder will produce next
+    u32 loop_start;
+    u32 loop_end; // zero means loop at the end of the stream
+    bool ended; // the decoder has run out and won't be looping
+
+    VolumeRamp ramp;
+    float volume;
+    float gains[2]; // for each side of stereo output, as of the last period
+    float x;
+    float y;
+    bool positioned;
+    bool gains_set;
+    int delay; // frames of silence before the stream starts
+    bool looping;
+    int bus;
+    StreamId id;
+};
+
+static Stream::DecoderType decoder_type_from_file_extension(const char* extension) {
+         if (strings_match(extension, "wav")) return Stream::DecoderType::Wave;
+    else if (strings_match(extension, "ogg")) return Stream::DecoderType::Vorbis;
+    return Stream::DecoderType::Wave;
+}
+
+static void fill_with_silence(float* samples, u8 silence, u64 count) {
+    std::memset(samples, silence, sizeof(float) * count);
+}
+
+#define MAX_STREAMS 64
+
+struct StreamManager {
+    Stream streams[MAX_STREAMS];
+    int stream_count;
+    AssetCache asset_cache;
+};
+
+static int close_stream(StreamManager* manager, int stream_index) {
+    assert(stream_index >= 0 && stream_index < manager->stream_count);
+
+    Stream* stream = manager->streams + stream_index;
+    switch (stream->decoder_type) {
+        case Stream::DecoderType::Vorbis: {
+            stb_vorbis_close(stream->vorbis.decoder);
+            break;
+        }
+        case Stream::DecoderType::Wave: {
+            wave_close_file(stream->wave.decoder);
+            break;
+        }
+        case Stream::DecoderType::Decoded: {
+            break;
+        }
+    }
+    if (stream->asset) {
+        if (stream->capturing) {
+            cancel_capture(&manager->asset_cache, stream->asset);
+        }
+        stop_using_asset(stream->asset);
+    }
+    DEALLOCATE_LOCKABLE_ARRAY(stream->decoded_samples, float,
+                              stream->channels * stream->decoded_capacity);
+    DEALLOCATE_LOCKABLE_ARRAY(stream->ahead.samples, float,
+                              stream->channels * stream->ahead.capacity);
+
+    int last = manager->stream_count - 1;
+    if (manager->stream_count > 1 && stream_index != last) {
+        manager->streams[stream_index] = manager->streams[last];
+    }
+    manager->stream_count -= 1;
+
+    return stream_index - 1;
+}
+
+static void close_stream_by_id(StreamManager* manager, StreamId stream_id) {
+    FOR_N(i, manager->stream_count) {
+        Stream* stream = manager->streams + i;
+        if (stream->id == stream_id) {
+            i = close_stream(manager, i);
+        }
+    }
+}
+
+static void close_all_streams(StreamManager* stream_manager) {
+    while (stream_manager->stream_count > 0) {
+        close_stream(stream_manager, 0);
+    }
+}
+
+// Decoding is kept this many periods ahead of mixing. That way, reaching a
+// loop point and seeking back happens while topping up after a period has
+// been sent to the device, and not while there's a period waiting to be mixed.
+#define DECODE_AHEAD_PERIODS 2
+
+static bool open_decoder(Stream* stream, const char* path, AudioAsset* asset) {
+    // Without an asset to read from, a file in the asset pack can still be
+    // read straight out of it, since the pack stays open until the mixer's
+    // shut down.
+    FileMapping packed;
+    if (asset && asset->mapping.data) {
+        packed = asset->mapping;
+    } else {
+        find_packed_file(&packed, path);
+    }
+
+    switch (stream->decoder_type) {
+        case Stream::DecoderType::Vorbis: {
+            stb_vorbis* decoder;
+            int open_error = 0;
+            if (packed.data) {
+                const u8* contents = static_cast<const u8*>(packed.data);
+                decoder = stb_vorbis_open_memory(contents, packed.size,
+                                                 &open_error, nullptr);
+            } else {
+                decoder = stb_vorbis_open_filename(path, &open_error,
+                                                   nullptr);
+            }
+            if (!decoder || open_error) {
+                REPORT_ERROR("Vorbis file %s failed to load: %i", path,
+                             open_error);
+                return false;
+            }
+            stream->vorbis.decoder = decoder;
+
+            stb_vorbis_info info = stb_vorbis_get_info(stream->vorbis.decoder);
+            stream->channels = info.channels;
+            if (asset) {
+                asset->frame_count = stb_vorbis_stream_length_in_samples(decoder);
+            }
+            break;
+        }
+        case Stream::DecoderType::Wave: {
+            WaveDecoder* decoder;
+            if (packed.data) {
+                decoder = wave_open_memory(packed.data, packed.size);
+            } else {
+                decoder = wave_open_file(path);
+            }
+            if (!decoder) {
+                REPORT_ERROR("Wave file %s failed to load.", path);
+                return false;
+            }
+            stream->wave.decoder = decoder;
+            stream->channels = wave_channels(decoder);
+            if (asset) {
+                asset->frame_count = wave_frame_count(decoder);
+            }
+            break;
+        }
+        case Stream::DecoderType::Decoded: {
+            stream->channels = asset->channels;
+            break;
+        }
+    }
+    if (asset) {
+        asset->channels = stream->channels;
+    }
+    return true;
+}
+
+static Stream* open_stream(StreamManager* stream_manager,
+                           const char* filename, int frames, float volume,
+                           bool looping, int bus, int delay,
+                           StreamId id = 0) {
+    if (stream_manager->stream_count >= MAX_STREAMS) {
+        REPORT_ERROR("Too many streams are playing to start %s.", filename);
+        return nullptr;
+    }
+
+    Stream* stream = stream_manager->streams + stream_manager->stream_count;
+
+    const char* file_extension = std::strstr(filename, ".") + 1;
+    stream->decoder_type = decoder_type_from_file_extension(file_extension);
+
+    char path[256];
+    copy_string(path, "Assets/", sizeof path);
+    append_string(path, filename, sizeof path);
+
+    // Decide how the file should be held, based on how it's been used. The
+    // stream counts as a user from the start, so that making room for it
+    // can't release the asset out from under it.
+    AssetCache* cache = &stream_manager->asset_cache;
+    AudioAsset* asset = find_asset(cache, path);
+    if (asset) {
+        asset->users += 1;
+        if (asset->decoded) {
+            stream->decoder_type = Stream::DecoderType::Decoded;
+        } else if (map_asset(asset) && !asset->held &&
+                   should_hold_compressed(asset)) {
+            hold_asset(cache, asset);
+        }
+    }
+
+    if (!open_decoder(stream, path, asset)) {
+        if (asset) {
+            stop_using_asset(asset);
+        }
+        return nullptr;
+    }
+
+    stream->asset = asset;
+    stream->capturing = false;
+    if (asset) {
+        if (!asset->decoded && !asset->capturing &&
+                should_hold_decoded(asset)) {
+            stream->capturing = begin_capture(cache, asset);
+        }
+    }
+
+    int channels = stream->channels;
+    stream->decoded_samples = ALLOCATE_LOCKABLE_ARRAY(float, channels * frames);
+    stream->decoded_capacity = frames;
+    stream->ahead.capacity = DECODE_AHEAD_PERIODS * frames;
+    stream->ahead.samples = ALLOCATE_LOCKABLE_ARRAY(float,
+                                                    channels * stream->ahead.capacity);
+    lock_memory(stream->decoded_samples, sizeof(float) * channels * frames);
+    lock_memory(stream->ahead.samples,
+                sizeof(float) * channels * stream->ahead.capacity);
+    stream->ahead.start = 0;
+    stream->ahead.count = 0;
+    stream->position = 0;
+    stream->loop_start = 0;
+    stream->loop_end = 0;
+    stream->ended = false;
+    stream->ramp.frames = 0;
+    stream->volume = volume;
+    stream->positioned = false;
+    stream->gains_set = false;
+    stream->delay = delay;
+    stream->looping = looping;
+    stream->bus = bus;
+    stream->id = id;
+    stream_manager->stream_count += 1;
+
+    return stream;
+}
+
+static int decode_frames(Stream* stream, float* samples, int frames) {
+    int channels = stream->channels;
+    int samples_to_decode = channels * frames;
+    switch (stream->decoder_type) {
+        case Stream::DecoderType::Vorbis: {
+            return stb_vorbis_get_samples_float_interleaved(stream->vorbis.decoder, channels, samples, samples_to_decode);
+        }
+        case Stream::DecoderType::Wave: {
+            return wave_decode_interleaved(stream->wave.decoder, channels, samples, samples_to_decode);
+        }
+        case Stream::DecoderType::Decoded: {
+            AudioAsset* asset = stream->asset;
+            u64 frames_left = asset->frame_count - stream->position;
+            if (static_cast<u64>(frames) > frames_left) {
+                frames = frames_left;
+            }
+            const float* decoded = asset->samples + stream->position * channels;
+            std::memcpy(samples, decoded, sizeof(float) * channels * frames);
+            return frames;
+        }
+    }
+    return 0;
+}
+
+static void seek_stream(Stream* stream, u32 frame) {
+    switch (stream->decoder_type) {
+        case Stream::DecoderType::Vorbis: {
+            if (frame == 0) {
+                stb_vorbis_seek_start(stream->vorbis.decoder);
+            } else {
+                stb_vorbis_seek(stream->vorbis.decoder, frame);
+            }
+            break;
+        }
+        case Stream::DecoderType::Wave: {
+            wave_seek(stream->wave.decoder, frame);
+            break;
+        }
+        case Stream::DecoderType::Decoded: {
+            if (frame > stream->asset->frame_count) {
+                frame = stream->asset->frame_count;
+            }
+            break;
+        }
+    }
+    stream->position = frame;
+}
+
+// Fills up the ring of frames decoded ahead to hold the given number, going
+// back to the loop start whenever the loop end is reached, so the frames
+// either side of a loop point sit next to one another.
+static void decode_ahead(AssetCache* cache, Stream* stream, int frames_ahead) {
+    int channels = stream->channels;
+    int capacity = stream->ahead.capacity;
+    if (frames_ahead > capacity) {
+        frames_ahead = capacity;
+    }
+    bool just_seeked = false;
+
+    while (stream->ahead.count < frames_ahead && !stream->ended) {
+        int end = (stream->ahead.start + stream->ahead.count) % capacity;
+        int frames = frames_ahead - stream->ahead.count;
+        if (frames > capacity - end) {
+            frames = capacity - end;
+        }
+
+        bool at_loop_end = false;
+        if (stream->looping && stream->loop_end > 0) {
+            u64 frames_left = 0;
+            if (stream->loop_end > stream->position) {
+                frames_left = stream->loop_end - stream->position;
+            }
+            if (static_cast<u64>(frames) >= frames_left) {
+                frames = frames_left;
+                at_loop_end = true;
+            }
+        }
+
+        int frames_decoded = 0;
+        if (frames > 0) {
+            float* samples = stream->ahead.samples + end * channels;
+            frames_decoded = decode_frames(stream, samples, frames);
+            if (stream->capturing) {
+                capture_frames(cache, stream->asset, stream->position,
+                               samples, frames_decoded);
+                stream->capturing = stream->asset->capturing;
+            }
+        }
+        stream->ahead.count += frames_decoded;
+        stream->position += frames_decoded;
+        if (frames_decoded > 0) {
+            just_seeked = false;
+        }
+
+        if (frames_decoded < frames || at_loop_end) {
+            if (stream->capturing) {
+                AudioAsset* asset = stream->asset;
+                if (frames_decoded < frames ||
+                        asset->frames_captured == asset->frames_allocated) {
+                    finish_capture(cache, asset);
+                } else {
+                    cancel_capture(cache, asset);
+                }
+                stream->capturing = false;
+            }
+
+            // Nothing coming out right after seeking back means there's
+            // nothing in the loop, so give up rather than spin.
+            if (stream->looping && !just_seeked) {
+                seek_stream(stream, stream->loop_start);
+                just_seeked = true;
+            } else {
+                stream->ended = true;
+            }
+        }
+    }
+}
+
+static int take_decoded_frames(Stream* stream, float* samples, int frames) {
+    int channels = stream->channels;
+    int capacity = stream->ahead.capacity;
+    int frames_taken = 0;
+    while (frames_taken < frames && stream->ahead.count > 0) {
+        int count = frames - frames_taken;
+        if (count > stream->ahead.count) {
+            count = stream->ahead.count;
+        }
+        if (count > capacity - stream->ahead.start) {
+            count = capacity - stream->ahead.start;
+        }
+        std::memcpy(samples + frames_taken * channels,
+                    stream->ahead.samples + stream->ahead.start * channels,
+                    sizeof(float) * count * channels);
+        stream->ahead.start = (stream->ahead.start + count) % capacity;
+        stream->ahead.count -= count;
+        frames_taken += count;
+    }
+    return frames_taken;
+}
+
+static void decode_streams(StreamManager* stream_manager, int frames) {
+    FOR_N(i, stream_manager->stream_count) {
+        Stream* stream = stream_manager->streams + i;
+        int channels = stream->channels;
+
+        // Streams which start partway into the period are preceded by silence.
+        int delay = stream->delay;
+        assert(delay >= 0 && delay < frames);
+        fill_with_silence(stream->decoded_samples, 0, delay * channels);
+        float* decoded_samples = stream->decoded_samples + delay * channels;
+        int frames_to_decode = frames - delay;
+        stream->delay = 0;
+
+        // The frames are usually there already, unless the stream only just
+        // started.
+        if (stream->ahead.count < frames_to_decode) {
+            decode_ahead(&stream_manager->asset_cache, stream,
+                         DECODE_AHEAD_PERIODS * frames);
+        }
+        int frames_decoded = take_decoded_frames(stream, decoded_samples,
+                                                 frames_to_decode);
+        int samples_needed = (frames_to_decode - frames_decoded) * channels;
+        fill_with_silence(decoded_samples + frames_decoded * channels, 0,
+                          samples_needed);
+    }
+}
+
+// After a period is mixed, this gets the frames for the next one ready and
+// closes any streams which have finished playing.
+static void decode_streams_ahead(StreamManager* stream_manager, int frames) {
+    FOR_N(i, stream_manager->stream_count) {
+        Stream* stream = stream_manager->streams + i;
+        if (stream->ended && stream->ahead.count == 0) {
+            i = close_stream(stream_manager, i);
+        } else {
+            decode_ahead(&stream_manager->asset_cache, stream,
+                         DECODE_AHEAD_PERIODS * frames);
+        }
+    }
+}
+
+// Stereo output is mixed with a separate gain for each side, which is moved
+// in a straight line from where it was at the end of the last period.
+struct ChannelGains {
+    float from[2];
+    float step[2]; // per frame
+};
+
+static void mix_frames_stereo(const float* in, int in_channels, float* out,
+                              int frames, float volume, float left,
+                              float right, float left_step,
+                              float right_step) {
+    left *= volume;
+    right *= volume;
+    left_step *= volume;
+    right_step *= volume;
+
+    int j = 0;
+#if defined(__SSE2__)
+    // Each vector holds two frames, so the gains for the second frame are
+    // a step further along.
+    __m128 gain4 = _mm_setr_ps(left + left_step, right + right_step,
+                               left + 2.0f * left_step,
+                               right + 2.0f * right_step);
+    __m128 step4 = _mm_setr_ps(2.0f * left_step, 2.0f * right_step,
+                               2.0f * left_step, 2.0f * right_step);
+    if (in_channels == 2) {
+        for (; j + 2 <= frames; j += 2) {
+            __m128 x = _mm_loadu_ps(in + 2 * j);
+            __m128 y = _mm_loadu_ps(out + 2 * j);
+            _mm_storeu_ps(out + 2 * j, _mm_add_ps(y, _mm_mul_ps(x, gain4)));
+            gain4 = _mm_add_ps(gain4, step4);
+        }
+    } else {
+        // Duplicate each mono sample across both sides of a frame.
+        for (; j + 4 <= frames; j += 4) {
+            __m128 x = _mm_loadu_ps(in + j);
+            __m128 low = _mm_unpacklo_ps(x, x);
+            __m128 high = _mm_unpackhi_ps(x, x);
+            __m128 y = _mm_loadu_ps(out + 2 * j);
+            _mm_storeu_ps(out + 2 * j, _mm_add_ps(y, _mm_mul_ps(low, gain4)));
+            gain4 = _mm_add_ps(gain4, step4);
+            y = _mm_loadu_ps(out + 2 * j + 4);
+            _mm_storeu_ps(out + 2 * j + 4, _mm_add_ps(y, _mm_mul_ps(high, gain4)));
+            gain4 = _mm_add_ps(gain4, step4);
+        }
+    }
+#endif
+    int right_offset = in_channels - 1;
+    for (; j < frames; ++j) {
+        out[2*j]     += (left + left_step * (j + 1)) * in[j*in_channels];
+        out[2*j + 1] += (right + right_step * (j + 1)) * in[j*in_channels+right_offset];
+    }
+}
+
+static void mix_frames(const Stream* stream, float* mix_buffer, int start,
+                       int end, int channels, const ChannelGains* gains) {
+    float* out = mix_buffer + start * channels;
+    const float* in = stream->decoded_samples + start * stream->channels;
+    int frames = end - start;
+    int samples = frames * channels;
+
+    if (channels == 2 && stream->channels <= 2) {
+        float left = gains->from[0] + gains->step[0] * start;
+        float right = gains->from[1] + gains->step[1] * start;
+        mix_frames_stereo(in, stream->channels, out, frames, stream->volume,
+                          left, right, gains->step[0], gains->step[1]);
+        return;
+    }
+
+    // Mix the stream's samples into the given buffer.
+    // @Incomplete: Positioning only applies to stereo output.
+    if (channels < stream->channels) {
+        FOR_N(j, frames) {
+            FOR_N(k, channels) {
+                out[j*channels+k] += stream->volume * in[j*stream->channels];
+            }
+        }
+    } else if (channels > stream->channels) {
+        assert(stream->channels == 1); // @Incomplete: This path doesn't actually handle stereo-to-surround mixing
+        FOR_N(j, frames) {
+            float sample = stream->volume * in[j*stream->channels];
+            FOR_N(k, channels) {
+                out[j*channels+k] += sample;
+            }
+        }
+    } else {
+        FOR_N(j, samples) {
+            out[j] += stream->volume * in[j];
+        }
+    }
+}
+
+static void mix_frame(const float* in, int in_channels, float* out,
+                      int out_channels, float volume, const float* gains) {
+    if (out_channels == 2 && in_channels <= 2) {
+        out[0] += volume * gains[0] * in[0];
+        out[1] += volume * gains[1] * in[in_channels - 1];
+    } else if (out_channels == in_channels) {
+        FOR_N(k, out_channels) {
+            out[k] += volume * in[k];
+        }
+    } else {
+        float sample = volume * in[0];
+        FOR_N(k, out_channels) {
+            out[k] += sample;
+        }
+    }
+}
+
+static void start_volume_ramp(Stream* stream) {
+    // An exponential ramp can never reach silence, so it's clamped to a floor
+    // of -60dB and snapped to the target when it ends.
+    const float minimum = 0.001f;
+
+    VolumeRamp* ramp = &stream->ramp;
+    if (ramp->fade == Fade::Exponential) {
+        float from = std::fmax(stream->volume, minimum);
+        float to = std::fmax(ramp->target, minimum);
+        ramp->step = std::pow(to / from, 1.0f / ramp->frames);
+        stream->volume = from;
+    } else {
+        ramp->step = (ramp->target - stream->volume) / ramp->frames;
+    }
+    ramp->started = true;
+}
+
+static void mix_stream(Stream* stream, float* mix_buffer, int frames,
+                       int channels, const ChannelGains* gains) {
+    VolumeRamp* ramp = &stream->ramp;
+    int frame = 0;
+
+    // Mix at a fixed volume until a ramp is due to start.
+    if (ramp->frames > 0 && ramp->delay > 0) {
+        int end = ramp->delay < frames ? ramp->delay : frames;
+        mix_frames(stream, mix_buffer, 0, end, channels, gains);
+        ramp->delay -= end;
+        frame = end;
+    }
+
+    // Then change the volume frame by frame for as long as the ramp lasts.
+    if (ramp->frames > 0 && ramp->delay == 0 && frame < frames) {
+        if (!ramp->started) {
+            start_volume_ramp(stream);
+        }
+        int end = frame + ramp->frames;
+        if (end > frames) {
+            end = frames;
+        }
+        ramp->frames -= end - frame;
+
+        float volume = stream->volume;
+        bool linear = ramp->fade == Fade::Linear;
+        for (; frame < end; ++frame) {
+            volume = linear ? volume + ramp->step : volume * ramp->step;
+            float frame_gains[2];
+            FOR_N(k, 2) {
+                frame_gains[k] = gains->from[k] + gains->step[k] * (frame + 1);
+            }
+            mix_frame(stream->decoded_samples + frame * stream->channels,
+                      stream->channels, mix_buffer + frame * channels,
+                      channels, volume, frame_gains);
+        }
+        stream->volume = ramp->frames == 0 ? ramp->target : volume;
+    }
+
+    if (frame < frames) {
+        mix_frames(stream, mix_buffer, frame, frames, channels, gains);
+    }
+}
+
+static void set_stream_volume(Stream* stream, float volume, int fade_frames,
+                              Fade fade, int delay) {
+    VolumeRamp* ramp = &stream->ramp;
+    ramp->target = volume;
+    ramp->delay = delay;
+    ramp->frames = fade_frames > 0 ? fade_frames : 1;
+    ramp->fade = fade;
+    ramp->started = false;
+}
+
+// Limiter Functions...........................................................
+//     The master bus goes through a brickwall limiter rather than being
+//     clipped, so that when several loud streams overlap the whole mix is
+//     turned down smoothly instead of distorting.
+//
+//     The signal is delayed by a short lookahead so the gain can already be
+//     ramped down by the time a peak comes out. Gain is worked out once per
+//     block: the target for the end of each block is low enough for every
+//     sample still waiting in the delay line, and the gain is ramped linearly
+//     from the end of the last block to it. Since both ends of the ramp are
+//     low enough for every sample that comes out during the block, so is
+//     everything in between, and the output never goes over the ceiling.
+
+#define LIMITER_LOOKAHEAD_FRAMES 64
+
+struct Limiter {
+    float* delay; // lookahead frames waiting to go out, then the newest block
+    int channels;
+    float gain;
+    float ceiling;
+    float release; // how much of the distance to a higher gain is left per block
+};
+
+static void create_limiter(Limiter* limiter, int channels, u32 sample_rate) {
+    const float release_time = 0.08f; // in seconds
+    const float ceiling = 0.98f; // just under full scale
+
+    int delay_samples = 2 * LIMITER_LOOKAHEAD_FRAMES * channels;
+    limiter->delay = ALLOCATE_LOCKABLE_ARRAY(float, delay_samples);
+    fill_with_silence(limiter->delay, 0, delay_samples);
+    limiter->channels = channels;
+    limiter->gain = 1.0f;
+    limiter->ceiling = ceiling;
+
+    float block_time = static_cast<float>(LIMITER_LOOKAHEAD_FRAMES) /
+                       static_cast<float>(sample_rate);
+    limiter->release = std::exp(-block_time / release_time);
+}
+
+static void destroy_limiter(Limiter* limiter) {
+    DEALLOCATE_LOCKABLE_ARRAY(limiter->delay, float,
+                              2 * LIMITER_LOOKAHEAD_FRAMES * limiter->channels);
+}
+
+static float find_peak(const float* samples, int count) {
+    int i = 0;
+    float peak = 0.0f;
+#if defined(__SSE2__)
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 peak4 = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_andnot_ps(sign_mask, _mm_loadu_ps(samples + i));
+        peak4 = _mm_max_ps(peak4, x);
+    }
+    peak4 = _mm_max_ps(peak4, _mm_movehl_ps(peak4, peak4));
+    peak4 = _mm_max_ss(peak4, _mm_shuffle_ps(peak4, peak4, 1));
+    peak = _mm_cvtss_f32(peak4);
+#endif
+    for (; i < count; ++i) {
+        float x = std::fabs(samples[i]);
+        if (x > peak) {
+            peak = x;
+        }
+    }
+    return peak;
+}
+
+// Multiplies the samples by a gain which starts at the given value and goes
+// up by the given step each frame.
+static void apply_gain_ramp(const float* in, float* out, int frames,
+                            int channels, float gain, float step) {
+    int i = 0;
+    int samples = frames * channels;
+#if defined(__SSE2__)
+    if (channels <= 4 && 4 % channels == 0) {
+        // Each vector covers a whole number of frames, so the ramp for the
+        // first vector can just be moved along by a fixed amount.
+        float ramp[4];
+        FOR_N(j, 4) {
+            ramp[j] = gain + step * (j / channels + 1);
+        }
+        __m128 gain4 = _mm_loadu_ps(ramp);
+        __m128 step4 = _mm_set1_ps(step * (4 / channels));
+        for (; i + 4 <= samples; i += 4) {
+            __m128 x = _mm_loadu_ps(in + i);
+            _mm_storeu_ps(out + i, _mm_mul_ps(x, gain4));
+            gain4 = _mm_add_ps(gain4, step4);
+        }
+    }
+#endif
+    for (; i < samples; ++i) {
+        out[i] = in[i] * (gain + step * (i / channels + 1));
+    }
+}
+
+static void limit_block(Limiter* limiter, float* samples, int frames) {
+    int channels = limiter->channels;
+    int lookahead = LIMITER_LOOKAHEAD_FRAMES * channels;
+    int count = frames * channels;
+
+    // Queue up the block behind what's already waiting in the delay line.
+    float* delay = limiter->delay;
+    std::memcpy(delay + lookahead, samples, sizeof(float) * count);
+
+    float peak = find_peak(delay, lookahead + count);
+    float target = 1.0f;
+    if (peak > limiter->ceiling) {
+        target = limiter->ceiling / peak;
+    }
+
+    // Attack instantly by ramping all the way to the target over this block,
+    // but release gradually.
+    float gain = limiter->gain;
+    if (target > gain) {
+        target += (gain - target) * limiter->release;
+    }
+
+    float step = (target - gain) / frames;
+    apply_gain_ramp(delay, samples, frames, channels, gain, step);
+    limiter->gain = target;
+
+    std::memmove(delay, delay + count, sizeof(float) * lookahead);
+}
+
+static void apply_limiter(Limiter* limiter, float* samples, int frames) {
+    // Blocks can't be any longer than the lookahead, or samples could come
+    // out of the delay line without having been seen by an earlier block.
+    int channels = limiter->channels;
+    for (int i = 0; i < frames; i += LIMITER_LOOKAHEAD_FRAMES) {
+        int block_frames = frames - i;
+        if (block_frames > LIMITER_LOOKAHEAD_FRAMES) {
+            block_frames = LIMITER_LOOKAHEAD_FRAMES;
+        }
+        limit_block(limiter, samples + i * channels, block_frames);
+    }
+}
+
+// Positional Functions........................................................
+//     Streams can be given a position in the world, which is heard relative
+//     to a listener. Sources are quieter the further they are beyond the
+//     reference distance, and are panned by the sine of their angle from
+//     straight ahead, using a constant-power pan law so they don't dip in
+//     loudness as they cross the middle. Distances are in world units.
+
+struct Listener {
+    float x;
+    float y;
+    float reference_distance; // the distance within which there's no falloff
+    float rolloff;
+};
+
+static void reset_listener(Listener* listener) {
+    listener->x = 0.0f;
+    listener->y = 0.0f;
+    listener->reference_distance = 64.0f;
+    listener->rolloff = 1.0f;
+}
+
+static void compute_positional_gains(const Listener* listener, float x,
+                                     float y, float* gains) {
+    const float quarter_pi = 0.785398163f;
+
+    float dx = x - listener->x;
+    float dy = y - listener->y;
+    float distance = std::sqrt(dx * dx + dy * dy);
+
+    float reference = listener->reference_distance;
+    float attenuation = 1.0f;
+    if (distance > reference) {
+        attenuation = reference /
+                      (reference + listener->rolloff * (distance - reference));
+    }
+
+    // Sources right next to the listener aren't panned hard to one side.
+    float pan = dx / std::fmax(distance, reference);
+    float angle = (pan + 1.0f) * quarter_pi;
+    gains[0] = attenuation * std::cos(angle);
+    gains[1] = attenuation * std::sin(angle);
+}
+
+// Bus Functions...............................................................
+//     Streams are mixed into buses. Each bus is then scaled by its gain, run
+//     through its effect if it has one, and added into its parent. Buses are
+//     processed children first, so by the time a bus is reached everything
+//     feeding into it has already been mixed in. The master bus has no parent
+//     and is what gets sent to the device.
+//
+//     All the bus buffers are carved out of one allocation made up front, so
+//     nothing is allocated on the mixer thread while mixing.
+
+#define BUS_COUNT 5
+
+typedef void (*EffectProcess)(void* state, float* samples, int frames);
+
+struct Effect {
+    EffectProcess process;
+    void* state;
+};
+
+struct MixBus {
+    float* samples;
+    Effect effect;
+    int parent; // the bus this one is mixed into, or -1 for the master bus
+    float gain;
+    float applied_gain; // the gain reached at the end of the last period
+    bool mute;
+};
+
+struct BusGraph {
+    MixBus buses[BUS_COUNT];
+    int order[BUS_COUNT]; // every bus comes before its parent
+    float* pool;
+    int channels;
+    int frames; // the most frames a bus can hold for one period
+};
+
+static int bus_depth(BusGraph* graph, int bus) {
+    int depth = 0;
+    for (int i = graph->buses[bus].parent; i != -1; i = graph->buses[i].parent) {
+        depth += 1;
+    }
+    return depth;
+}
+
+static void sort_buses(BusGraph* graph) {
+    // Putting the deepest buses first means every bus comes before its parent.
+    int depths[BUS_COUNT];
+    FOR_N(i, BUS_COUNT) {
+        depths[i] = bus_depth(graph, i);
+    }
+    FOR_N(i, BUS_COUNT) {
+        int bus = i;
+        int j = i;
+        for (; j > 0 && depths[graph->order[j - 1]] < depths[bus]; --j) {
+            graph->order[j] = graph->order[j - 1];
+        }
+        graph->order[j] = bus;
+    }
+}
+
+static void create_bus_graph(BusGraph* graph, int channels, int frames) {
+    int samples = channels * frames;
+    graph->pool = ALLOCATE_LOCKABLE_ARRAY(float, BUS_COUNT * samples);
+    fill_with_silence(graph->pool, 0, BUS_COUNT * samples);
+    graph->channels = channels;
+    graph->frames = frames;
+
+    FOR_N(i, BUS_COUNT) {
+        MixBus* bus = graph->buses + i;
+        bus->samples = graph->pool + i * samples;
+        bus->effect.process = nullptr;
+        bus->effect.state = nullptr;
+        bus->parent = static_cast<int>(Bus::Master);
+        bus->gain = 1.0f;
+        bus->applied_gain = 1.0f;
+        bus->mute = false;
+    }
+    graph->buses[static_cast<int>(Bus::Master)].parent = -1;
+
+    sort_buses(graph);
+}
+
+static void destroy_bus_graph(BusGraph* graph) {
+    DEALLOCATE_LOCKABLE_ARRAY(graph->pool, float,
+                              BUS_COUNT * graph->channels * graph->frames);
+}
+
+static void set_bus_effect(BusGraph* graph, Bus bus, EffectProcess process,
+                           void* state) {
+    Effect* effect = &graph->buses[static_cast<int>(bus)].effect;
+    effect->process = process;
+    effect->state = state;
+}
+
+static void mix_streams(StreamManager* stream_manager, BusGraph* graph,
+                        const Listener* listener, int frames) {
+    FOR_N(i, BUS_COUNT) {
+        fill_with_silence(graph->buses[i].samples, 0, graph->channels * frames);
+    }
+    FOR_N(i, stream_manager->stream_count) {
+        Stream* stream = stream_manager->streams + i;
+
+        // Work out where the gains for each side should be by the end of the
+        // period, and ramp to them from where they were.
+        float target[2] = {1.0f, 1.0f};
+        if (stream->positioned) {
+            compute_positional_gains(listener, stream->x, stream->y, target);
+        }
+        if (!stream->gains_set) {
+            stream->gains[0] = target[0];
+            stream->gains[1] = target[1];
+            stream->gains_set = true;
+        }
+        ChannelGains gains;
+        FOR_N(k, 2) {
+            gains.from[k] = stream->gains[k];
+            gains.step[k] = (target[k] - stream->gains[k]) / frames;
+            stream->gains[k] = target[k];
+        }
+
+        float* mix_buffer = graph->buses[stream->bus].samples;
+        mix_stream(stream, mix_buffer, frames, graph->channels, &gains);
+    }
+}
+
+static void mix_buses(BusGraph* graph, int frames) {
+    int channels = graph->channels;
+    int samples = frames * channels;
+
+    FOR_N(i, BUS_COUNT) {
+        MixBus* bus = graph->buses + graph->order[i];
+
+        // Ramp to a changed gain over the period, so it doesn't click.
+        float gain = bus->mute ? 0.0f : bus->gain;
+        if (gain != 1.0f || bus->applied_gain != 1.0f) {
+            float step = (gain - bus->applied_gain) / frames;
+            apply_gain_ramp(bus->samples, bus->samples, frames, channels,
+                            bus->applied_gain, step);
+            bus->applied_gain = gain;
+        }
+
+        if (bus->effect.process) {
+            bus->effect.process(bus->effect.state, bus->samples, frames);
+        }
+
+        if (bus->parent != -1) {
+            float* parent_samples = graph->buses[bus->parent].samples;
+            FOR_N(j, samples) {
+                parent_samples[j] += bus->samples[j];
+            }
+        }
+    }
+}
+
+// Message Queue...............................................................
+
+struct Message {
+    enum class Code {
+        Play_Once,
+        Start_Stream,
+        Stop_Stream,
+        Set_Loop,
+        Set_Volume,
+        Set_Position,
+        Set_Listener,
+        Set_Falloff,
+        Set_Bus_Gain,
+        Set_Bus_Mute,
+    } code;
+
+    double time; // on the audio clock, when the message should take effect
+
+    union {
+        struct {
+            char filename[128];
+            float volume;
+            int bus;
+            bool positioned;
+            float x;
+            float y;
+        } play_once;
+
+        struct {
+            char filename[128];
+            StreamId stream_id;
+            float volume;
+            int bus;
+        } start_stream;
+
+        struct {
+            StreamId stream_id;
+        } stop_stream;
+
+        struct {
+            StreamId stream_id;
+            u32 start_frame;
+            u32 end_frame;
+        } set_loop;
+
+        struct {
+            StreamId stream_id;
+            float volume;
+            float fade_time;
+            Fade fade;
+        } set_volume;
+
+        struct {
+            StreamId stream_id;
+            float x;
+            float y;
+        } set_position;
+
+        struct {
+            float x;
+            float y;
+        } set_listener;
+
+        struct {
+            float reference_distance;
+            float rolloff;
+        } set_falloff;
+
+        struct {
+            int bus;
+            float gain;
+        } set_bus_gain;
+
+        struct {
+            int bus;
+            bool mute;
+        } set_bus_mute;
+    };
+};
+
+#define MAX_MESSAGES 32
+
+struct MessageQueue {
+    Message messages[MAX_MESSAGES];
+    AtomicInt head;
+    AtomicInt tail;
+};
+
+static bool was_empty(MessageQueue* queue) {
+    return atomic_int_load(&queue->head) == atomic_int_load(&queue->tail);
+}
+
+static bool was_full(MessageQueue* queue) {
+    int next_tail = atomic_int_load(&queue->tail);
+    next_tail = (next_tail + 1) % MAX_MESSAGES;
+    return next_tail == atomic_int_load(&queue->head);
+}
+
+static bool enqueue_message(MessageQueue* queue, Message* message) {
+    int current_tail = atomic_int_load(&queue->tail);
+    int next_tail = (current_tail + 1) % MAX_MESSAGES;
+    if (next_tail != atomic_int_load(&queue->head)) {
+        queue->messages[current_tail] = *message;
+        atomic_int_store(&queue->tail, next_tail);
+        return true;
+    }
+    return false;
+}
+
+static bool dequeue_message(MessageQueue* queue, Message* message) {
+    int current_head = atomic_int_load(&queue->head);
+    if (current_head == atomic_int_load(&queue->tail)) {
+        return false;
+    }
+    *message = queue->messages[current_head];
+    atomic_int_store(&queue->head, (current_head + 1) % MAX_MESSAGES);
+    return true;
+}
+
+// Looks at the message at the front of the queue without taking it off, so
+// that it can be left there if it can't be dealt with yet.
+static Message* peek_message(MessageQueue* queue) {
+    int current_head = atomic_int_load(&queue->head);
+    if (current_head == atomic_int_load(&queue->tail)) {
+        return nullptr;
+    }
+    return queue->messages + current_head;
+}
+
+static void pop_message(MessageQueue* queue) {
+    int current_head = atomic_int_load(&queue->head);
+    atomic_int_store(&queue->head, (current_head + 1) % MAX_MESSAGES);
+}
+
+// Scheduling Functions........................................................
+//     Messages are normally dealt with at the start of the next period, but
+//     those with a time further ahead than that wait here. A message is
+//     applied during the period that contains its time, at the exact frame
+//     it falls on within the period.
+
+#define MAX_SCHEDULED_MESSAGES 32
+
+struct Schedule {
+    Message messages[MAX_SCHEDULED_MESSAGES];
+    int count;
+};
+
+static bool schedule_message(Schedule* schedule, Message* message) {
+    if (schedule->count >= MAX_SCHEDULED_MESSAGES) {
+        return false;
+    }
+    schedule->messages[schedule->count] = *message;
+    schedule->count += 1;
+    return true;
+}
+
+static void unschedule_message(Schedule* schedule, int index) {
+    schedule->count -= 1;
+    schedule->messages[index] = schedule->messages[schedule->count];
+}
+
+static u64 time_to_frame(double time, u32 sample_rate) {
+    if (time <= 0.0) {
+        return 0;
+    }
+    return static_cast<u64>(time * sample_rate + 0.5);
+}
+
+// Render Script Functions.....................................................
+//     A render script is a text file with a command on each line, starting
+//     with the time in seconds that it happens. Blank lines and ones starting
+//     with # are skipped. Streams are referred to by numbers of the script's
+//     choosing, other than 0, and a bus can be given by name at the end of a
+//     play or start command, like "music" or "sound_effects".
+//
+//         0.0 play Jump.wav 0.5
+//         0.0 play_at Jump.wav 0.5 10 -4
+//         0.0 start 1 grass.ogg 0.3 ambience
+//         0.5 loop 1 1000 5000
+//         1.0 volume 1 0.1 2.0 exponential
+//         1.0 position 1 -20 0
+//         1.0 listener 5 5
+//         1.0 falloff 64 1
+//         2.0 bus_gain music 0.5
+//         2.0 bus_mute ambience 1
+//         3.0 stop 1
+//         4.0 end
+//
+//     Every script needs an end command, since a looping stream would
+//     otherwise never finish. Lines are limited to 255 characters.
+
+struct RenderScript {
+    Message* messages; // in order of time
+    int message_count;
+    double end_time;
+};
+
+static bool parse_bus(const char* name, int* bus) {
+    static const char* names[BUS_COUNT] = {
+        "master", "music", "sound_effects", "ambience", "interface",
+    };
+    FOR_N(i, BUS_COUNT) {
+        if (strings_match(name, names[i])) {
+            *bus = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fills in a message from one line of a script, or returns false if the line
+// doesn't make sense. An end command sets the end time instead.
+static bool parse_command(const char* line, Message* message, bool* is_end,
+                          double* end_time) {
+    double time;
+    char command[16];
+    int consumed = 0;
+    if (std::sscanf(line, "%lf %15s %n", &time, command, &consumed) < 2) {
+        return false;
+    }
+    const char* arguments = line + consumed;
+    CLEAR_STRUCT(message);
+    message->time = time;
+    *is_end = false;
+
+    char name[128];
+    char bus[16];
+    unsigned int id;
+    float a;
+    float b;
+    float c;
+    if (strings_match(command, "play")) {
+        int count = std::sscanf(arguments, "%127s %f %15s", name, &a, bus);
+        message->code = Message::Code::Play_Once;
+        copy_string(message->play_once.filename, name,
+                    sizeof message->play_once.filename);
+        message->play_once.volume = a;
+        message->play_once.bus = static_cast<int>(Bus::Sound_Effects);
+        message->play_once.positioned = false;
+        return count == 2 ||
+               (count == 3 && parse_bus(bus, &message->play_once.bus));
+    } else if (strings_match(command, "play_at")) {
+        int count = std::sscanf(arguments, "%127s %f %f %f %15s", name, &a,
+                                &b, &c, bus);
+        message->code = Message::Code::Play_Once;
+        copy_string(message->play_once.filename, name,
+                    sizeof message->play_once.filename);
+        message->play_once.volume = a;
+        message->play_once.bus = static_cast<int>(Bus::Sound_Effects);
+        message->play_once.positioned = true;
+        message->play_once.x = b;
+        message->play_once.y = c;
+        return count == 4 ||
+               (count == 5 && parse_bus(bus, &message->play_once.bus));
+    } else if (strings_match(command, "start")) {
+        int count = std::sscanf(arguments, "%u %127s %f %15s", &id, name, &a,
+                                bus);
+        message->code = Message::Code::Start_Stream;
+        copy_string(message->start_stream.filename, name,
+                    sizeof message->start_stream.filename);
+        message->start_stream.stream_id = id;
+        message->start_stream.volume = a;
+        message->start_stream.bus = static_cast<int>(Bus::Music);
+        return (count == 3 && id != 0) ||
+               (count == 4 && id != 0 &&
+                parse_bus(bus, &message->start_stream.bus));
+    } else if (strings_match(command, "stop")) {
+        message->code = Message::Code::Stop_Stream;
+        return std::sscanf(arguments, "%u",
+                           &message->stop_stream.stream_id) == 1 &&
+               message->stop_stream.stream_id != 0;
+    } else if (strings_match(command, "loop")) {
+        message->code = Message::Code::Set_Loop;
+        message->set_loop.end_frame = 0;
+        return std::sscanf(arguments, "%u %u %u", &message->set_loop.stream_id,
+                           &message->set_loop.start_frame,
+                           &message->set_loop.end_frame) >= 2 &&
+               message->set_loop.stream_id != 0;
+    } else if (strings_match(command, "volume")) {
+        char fade[16];
+        message->code = Message::Code::Set_Volume;
+        message->set_volume.fade_time = 0.0f;
+        message->set_volume.fade = Fade::Linear;
+        int count = std::sscanf(arguments, "%u %f %f %15s",
+                                &message->set_volume.stream_id,
+                                &message->set_volume.volume,
+                                &message->set_volume.fade_time, fade);
+        if (count == 4) {
+            if (strings_match(fade, "exponential")) {
+                message->set_volume.fade = Fade::Exponential;
+            } else if (!strings_match(fade, "linear")) {
+                return false;
+            }
+        }
+        return count >= 2 && message->set_volume.stream_id != 0;
+    } else if (strings_match(command, "position")) {
+        message->code = Message::Code::Set_Position;
+        return std::sscanf(arguments, "%u %f %f",
+                           &message->set_position.stream_id,
+                           &message->set_position.x,
+                           &message->set_position.y) == 3 &&
+               message->set_position.stream_id != 0;
+    } else if (strings_match(command, "listener")) {
+        message->code = Message::Code::Set_Listener;
+        return std::sscanf(arguments, "%f %f", &message->set_listener.x,
+                           &message->set_listener.y) == 2;
+    } else if (strings_match(command, "falloff")) {
+        message->code = Message::Code::Set_Falloff;
+        return std::sscanf(arguments, "%f %f",
+                           &message->set_falloff.reference_distance,
+                           &message->set_falloff.rolloff) == 2;
+    } else if (strings_match(command, "bus_gain")) {
+        message->code = Message::Code::Set_Bus_Gain;
+        message->set_bus_gain.gain = 1.0f;
+        return std::sscanf(arguments, "%15s %f", bus,
+                           &message->set_bus_gain.gain) == 2 &&
+               parse_bus(bus, &message->set_bus_gain.bus);
+    } else if (strings_match(command, "bus_mute")) {
+        int mute = 0;
+        message->code = Message::Code::Set_Bus_Mute;
+        bool parsed = std::sscanf(arguments, "%15s %i", bus, &mute) == 2 &&
+                      parse_bus(bus, &message->set_bus_mute.bus);
+        message->set_bus_mute.mute = mute != 0;
+        return parsed;
+    } else if (strings_match(command, "end")) {
+        *end_time = time;
+        *is_end = true;
+        return true;
+    }
+    return false;
+}
+
+static bool load_render_script(RenderScript* script, const char* filename) {
+    std::FILE* file = std::fopen(filename, "r");
+    if (!file) {
+        LOG_ERROR("Couldn't open the render script %s.", filename);
+        return false;
+    }
+
+    // There can't be more commands than there are lines.
+    int line_count = 1;
+    for (int c = std::fgetc(file); c != EOF; c = std::fgetc(file)) {
+        if (c == '\n') {
+            line_count += 1;
+        }
+    }
+    std::rewind(file);
+
+    script->messages = ALLOCATE_ARRAY(Message, line_count);
+    script->message_count = 0;
+    script->end_time = -1.0;
+
+    char line[256];
+    int line_number = 0;
+    bool loaded = true;
+    while (std::fgets(line, sizeof line, file)) {
+        line_number += 1;
+
+        // The rest of a line that didn't fit would be read as more lines, so
+        // it's turned away. It fits if only its newline, or nothing at the
+        // end of the file, was left behind.
+        if (!std::strchr(line, '\n')) {
+            int c = std::fgetc(file);
+            if (c != EOF && c != '\n') {
+                LOG_ERROR("Line %i of the render script %s is too long.",
+                          line_number, filename);
+                loaded = false;
+                break;
             }
         }
+
+        const char* start = line + std::strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        Message* message = script->messages + script->message_count;
+        bool is_end;
+        if (!parse_command(start, message, &is_end, &script->end_time)) {
+            LOG_ERROR("Couldn't make sense of line %i of the render script "
+                      "%s.", line_number, filename);
+            loaded = false;
+            break;
+        }
+        if (is_end) {
+            continue;
+        }
+
+        // Keep the commands in order of time, with any at the same time in
+        // the order they were written.
+        int i = script->message_count;
+        Message inserted = *message;
+        for (; i > 0 && script->messages[i - 1].time > inserted.time; --i) {
+            script->messages[i] = script->messages[i - 1];
+        }
+        script->messages[i] = inserted;
+        script->message_count += 1;
     }
+    std::fclose(file);
 
-    // Clip the final amplitude of each sample to the range [-1,1].
-    FOR_N(i, samples) {
-        mix_buffer[i] = clamp(mix_buffer[i], -1.0f, 1.0f);
+    if (loaded && script->end_time < 0.0) {
+        LOG_ERROR("The render script %s has no end command.", filename);
+        loaded = false;
+    }
+    if (!loaded) {
+        DEALLOCATE_ARRAY(script->messages);
     }
+    return loaded;
 }
 
-// Message Queue...............................................................
-
-struct Message {
-    enum class Code {
-        Play_Once,
-        Start_Stream,
-        Stop_Stream,
-    } code;
-
-    union {
-        struct {
-            char filename[128];
-            float volume;
-        } play_once;
-
-        struct {
-            char filename[128];
-            StreamId stream_id;
-            float volume;
-        } start_stream;
-
-        struct {
-            StreamId stream_id;
-        } stop_stream;
-    };
-};
-
-#define MAX_MESSAGES 32
-
-struct MessageQueue {
-    Message messages[MAX_MESSAGES];
-    AtomicInt head;
-    AtomicInt tail;
+// Period Adaptation Functions.................................................
+//     A shorter period means less latency, but also less slack to get through
+//     a slow period before the device runs dry. So when asked for, the period
+//     is kept as short as it can be while staying clear of underruns. It
+//     doubles as soon as the device underruns or the work gets near the
+//     deadline, and halves only after a long stretch of light work with no
+//     trouble, never back down to a size which has underrun recently. The gap
+//     between the two thresholds and the wait before shrinking keep it from
+//     flapping between sizes. A real device keeps playing through a change,
+//     since only the point at which it wakes the mixer moves.
+
+#define MIN_PERIOD_FRAMES 256
+#define MAX_PERIOD_FRAMES 4096
+#define ADAPTATION_WINDOW_SECONDS 2.0
+#define CALM_WINDOWS_TO_SHRINK 4
+#define CALM_WINDOWS_TO_FORGIVE 30
+#define HIGH_PERIOD_LOAD 0.5
+#define LOW_PERIOD_LOAD 0.2
+
+struct PeriodAdapter {
+    double worst_load; // the largest fraction of a period spent working
+    double window_time;
+    u64 xruns; // the device's count at the start of the window
+    int missed_deadlines;
+    int calm_windows;
+    u64 unstable_frames; // the largest period which underran, or 0 if none
 };
 
-static bool was_empty(MessageQueue* queue) {
-    return atomic_int_load(&queue->head) == atomic_int_load(&queue->tail);
+static void reset_period_adapter(PeriodAdapter* adapter, u64 xruns) {
+    adapter->worst_load = 0.0;
+    adapter->window_time = 0.0;
+    adapter->xruns = xruns;
+    adapter->missed_deadlines = 0;
 }
 
-static bool was_full(MessageQueue* queue) {
-    int next_tail = atomic_int_load(&queue->tail);
-    next_tail = (next_tail + 1) % MAX_MESSAGES;
-    return next_tail == atomic_int_load(&queue->head);
+static void record_period_work(PeriodAdapter* adapter, double work,
+                               double period_time) {
+    double load = work / period_time;
+    if (load > adapter->worst_load) {
+        adapter->worst_load = load;
+    }
+    if (load > 1.0) {
+        adapter->missed_deadlines += 1;
+    }
+    adapter->window_time += period_time;
 }
 
-static bool enqueue_message(MessageQueue* queue, Message* message) {
-    int current_tail = atomic_int_load(&queue->tail);
-    int next_tail = (current_tail + 1) % MAX_MESSAGES;
-    if (next_tail != atomic_int_load(&queue->head)) {
-        queue->messages[current_tail] = *message;
-        atomic_int_store(&queue->tail, next_tail);
-        return true;
+// Returns the period size to switch to, which is the same as the one given
+// if it should stay as it is.
+static u64 adapt_period(PeriodAdapter* adapter, u64 xruns, u64 frames) {
+    bool underran = xruns > adapter->xruns || adapter->missed_deadlines > 0;
+    if (underran || adapter->worst_load > HIGH_PERIOD_LOAD) {
+        if (underran && frames > adapter->unstable_frames) {
+            adapter->unstable_frames = frames;
+        }
+        adapter->calm_windows = 0;
+        reset_period_adapter(adapter, xruns);
+        if (frames < MAX_PERIOD_FRAMES) {
+            return 2 * frames;
+        }
+        return frames;
     }
-    return false;
-}
 
-static bool dequeue_message(MessageQueue* queue, Message* message) {
-    int current_head = atomic_int_load(&queue->head);
-    if (current_head == atomic_int_load(&queue->tail)) {
-        return false;
+    if (adapter->window_time < ADAPTATION_WINDOW_SECONDS) {
+        return frames;
     }
-    *message = queue->messages[current_head];
-    atomic_int_store(&queue->head, (current_head + 1) % MAX_MESSAGES);
-    return true;
+    if (adapter->worst_load < LOW_PERIOD_LOAD) {
+        adapter->calm_windows += 1;
+    } else {
+        adapter->calm_windows = 0;
+    }
+    reset_period_adapter(adapter, xruns);
+
+    // Whatever caused an underrun a long while ago may well have gone away.
+    if (adapter->calm_windows >= CALM_WINDOWS_TO_FORGIVE) {
+        adapter->unstable_frames = 0;
+    }
+
+    u64 shorter = frames / 2;
+    if (adapter->calm_windows >= CALM_WINDOWS_TO_SHRINK &&
+            shorter >= MIN_PERIOD_FRAMES &&
+            shorter > adapter->unstable_frames) {
+        adapter->calm_windows = 0;
+        return shorter;
+    }
+    return frames;
 }
 
 // System Functions............................................................
 
+// Running totals for reporting how well the mixer kept up, once it's done.
+struct MixerTotals {
+    double start_time;
+    double bus_time;
+    double limiter_time; // which is also part of the bus time
+    double work_time;
+    double worst_work_time;
+    double deadline; // the length of the last period
+    u64 periods;
+    u64 missed_deadlines;
+    u64 period_changes;
+};
+
 namespace {
+    Settings settings;
     StreamManager stream_manager;
     MessageQueue message_queue;
+    Schedule schedule;
     ConversionInfo conversion_info;
     Specification specification;
-    snd_pcm_t* pcm_handle;
+    Device device;
+    Limiter limiter;
+    BusGraph bus_graph;
+    Listener listener;
+    PeriodAdapter period_adapter;
+    int max_period_frames; // what buffers are sized for, whatever the period
     float* mixed_samples;
     void* devicebound_samples;
     pthread_t thread;
     AtomicFlag quit;
     double time;
+    AtomicInt clock_frames; // frames mixed so far, shared with the main thread
     StreamId stream_id_seed;
+    MixerTotals mixer_totals;
+    bool messages_held_back; // because the schedule was full
 }
 
-static void* run_mixer_thread(void* argument) {
-    specification.channels = 2;
-    specification.format = FORMAT_S16;
-    specification.sample_rate = 44100;
-    specification.frames = 1024;
-    fill_remaining_specification(&specification);
-    if (!open_device("default", &specification, &pcm_handle)) {
-        LOG_ERROR("Failed to open audio device.");
+static double get_wall_time() {
+    timespec timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &timestamp);
+    return static_cast<double>(timestamp.tv_sec) +
+           static_cast<double>(timestamp.tv_nsec) / 1.0e9;
+}
+
+// Adds the time since a stage of the period started to its total, and returns
+// the time now, for the next stage to start from.
+static double end_stage(MixerStage stage, double start_time) {
+    double now = get_wall_time();
+    long nanoseconds = static_cast<long>(1.0e9 * (now - start_time));
+    add_to_total(mixer_monitor.stage_time + static_cast<int>(stage),
+                 nanoseconds);
+    return now;
+}
+
+// The limiter is the master bus's effect, and it's timed on its own as well
+// as along with the rest of the buses, so its cost can be told apart.
+static void process_limiter(void* state, float* samples, int frames) {
+    double limiter_start = get_wall_time();
+    apply_limiter(static_cast<Limiter*>(state), samples, frames);
+    mixer_totals.limiter_time += get_wall_time() - limiter_start;
+}
+
+// Applies a message which is due the given number of frames into the period.
+static void apply_message(Message* message, int delay) {
+    int frames = max_period_frames;
+    u32 sample_rate = specification.sample_rate;
+    switch (message->code) {
+        case Message::Code::Play_Once: {
+            Stream* stream = open_stream(&stream_manager,
+                                         message->play_once.filename, frames,
+                                         message->play_once.volume, false,
+                                         message->play_once.bus, delay);
+            if (stream && message->play_once.positioned) {
+                stream->positioned = true;
+                stream->x = message->play_once.x;
+                stream->y = message->play_once.y;
+            }
+            break;
+        }
+        case Message::Code::Start_Stream: {
+            open_stream(&stream_manager, message->start_stream.filename,
+                        frames, message->start_stream.volume, true,
+                        message->start_stream.bus, delay,
+                        message->start_stream.stream_id);
+            break;
+        }
+        case Message::Code::Stop_Stream: {
+            close_stream_by_id(&stream_manager,
+                               message->stop_stream.stream_id);
+            break;
+        }
+        case Message::Code::Set_Loop: {
+            FOR_N(i, stream_manager.stream_count) {
+                Stream* stream = stream_manager.streams + i;
+                if (stream->id == message->set_loop.stream_id) {
+                    stream->loop_start = message->set_loop.start_frame;
+                    stream->loop_end = message->set_loop.end_frame;
+                }
+            }
+            break;
+        }
+        case Message::Code::Set_Volume: {
+            int fade_frames = time_to_frame(message->set_volume.fade_time,
+                                            sample_rate);
+            FOR_N(i, stream_manager.stream_count) {
+                Stream* stream = stream_manager.streams + i;
+                if (stream->id == message->set_volume.stream_id) {
+                    set_stream_volume(stream, message->set_volume.volume,
+                                      fade_frames, message->set_volume.fade,
+                                      delay);
+                }
+            }
+            break;
+        }
+        case Message::Code::Set_Position: {
+            FOR_N(i, stream_manager.stream_count) {
+                Stream* stream = stream_manager.streams + i;
+                if (stream->id == message->set_position.stream_id) {
+                    stream->positioned = true;
+                    stream->x = message->set_position.x;
+                    stream->y = message->set_position.y;
+                }
+            }
+            break;
+        }
+        case Message::Code::Set_Listener: {
+            listener.x = message->set_listener.x;
+            listener.y = message->set_listener.y;
+            break;
+        }
+        case Message::Code::Set_Falloff: {
+            listener.reference_distance = message->set_falloff.reference_distance;
+            listener.rolloff = message->set_falloff.rolloff;
+            break;
+        }
+        case Message::Code::Set_Bus_Gain: {
+            MixBus* bus = bus_graph.buses + message->set_bus_gain.bus;
+            bus->gain = message->set_bus_gain.gain;
+            break;
+        }
+        case Message::Code::Set_Bus_Mute: {
+            MixBus* bus = bus_graph.buses + message->set_bus_mute.bus;
+            bus->mute = message->set_bus_mute.mute;
+            break;
+        }
+    }
+}
+
+static void process_messages(u64 period_start, int frames) {
+    u32 sample_rate = specification.sample_rate;
+    u64 period_end = period_start + frames;
+
+    // Apply any scheduled messages which have come due.
+    FOR_N(i, schedule.count) {
+        Message* message = schedule.messages + i;
+        u64 frame = time_to_frame(message->time, sample_rate);
+        if (frame < period_end) {
+            apply_message(message, frame - period_start);
+            unschedule_message(&schedule, i);
+            i -= 1;
+        }
+    }
+
+    // Then go through any new messages from the main thread. A message due
+    // after this period can't be applied in it, so if there's no room to
+    // schedule it, it's left at the front of the queue to try again next
+    // period, and everything behind it waits too.
+    while (Message* message = peek_message(&message_queue)) {
+        u64 frame = time_to_frame(message->time, sample_rate);
+        if (frame >= period_end) {
+            if (!schedule_message(&schedule, message)) {
+                if (!messages_held_back) {
+                    REPORT_ERROR("Too many audio messages were scheduled, so "
+                                 "the rest are waiting until there's room.");
+                    messages_held_back = true;
+                }
+                break;
+            }
+        } else {
+            int delay = 0;
+            if (frame > period_start) {
+                delay = frame - period_start;
+            }
+            apply_message(message, delay);
+        }
+        pop_message(&message_queue);
+    }
+    if (was_empty(&message_queue)) {
+        messages_held_back = false;
+    }
+}
+
+// Applies the scheduling policy and CPU affinity asked for in the settings.
+// Neither is essential, so if they can't be had the mixer thread just runs
+// like any other.
+static void configure_mixer_thread() {
+    if (settings.scheduling != Scheduling::Normal) {
+        int policy = SCHED_FIFO;
+        if (settings.scheduling == Scheduling::Round_Robin) {
+            policy = SCHED_RR;
+        }
+        // Sit in the middle of the range, which leaves room above for
+        // anything more urgent, like a sound server.
+        int lowest = sched_get_priority_min(policy);
+        int highest = sched_get_priority_max(policy);
+        sched_param parameters = {};
+        parameters.sched_priority = lowest + (highest - lowest) / 2;
+        int result = pthread_setschedparam(pthread_self(), policy,
+                                           &parameters);
+        if (result != 0) {
+            REPORT_ERROR("Couldn't give the mixer thread real-time "
+                         "priority: %s", std::strerror(result));
+        }
+    }
+
+    if (settings.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(settings.cpu, &cpus);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof cpus,
+                                            &cpus);
+        if (result != 0) {
+            REPORT_ERROR("Couldn't run the mixer thread on CPU %i: %s",
+                         settings.cpu, std::strerror(result));
+        }
     }
+}
+
+// Asks for CD-quality stereo in periods of 1024 frames.
+static void set_default_specification(Specification* specification) {
+    specification->channels = 2;
+    specification->format = FORMAT_S16;
+    specification->sample_rate = 44100;
+    specification->frames = 1024;
+    fill_remaining_specification(specification);
+}
 
-    std::size_t samples = specification.channels * specification.frames;
+// Opens the device chosen in the settings and sets up everything needed to
+// start mixing periods. If the device can't be opened, mixing carries on into
+// a null device instead, so streams still play out in time and nothing's
+// handed to a device that isn't there. Whether the chosen device opened is
+// still returned.
+static bool begin_mixing() {
+    u64 min_frames = 0;
+    u64 max_frames = 0;
+    if (settings.adaptive_period) {
+        min_frames = MIN_PERIOD_FRAMES;
+        max_frames = MAX_PERIOD_FRAMES;
+    }
+    set_default_specification(&specification);
+    bool opened = open_device(&device, settings.backend,
+                              settings.output_filename, &specification,
+                              min_frames, max_frames);
+    if (!opened) {
+        REPORT_ERROR("Failed to open audio device, so nothing will be heard.");
+        set_default_specification(&specification);
+        open_device(&device, Backend::Null, nullptr, &specification,
+                    min_frames, max_frames);
+    }
 
-    // Setup mixing.
-    mixed_samples = ALLOCATE_ARRAY(float, samples);
-    devicebound_samples = ALLOCATE_ARRAY(u8, specification.size);
-    fill_with_silence(mixed_samples, specification.silence, samples);
+    // Setup mixing. When the period size can change, everything is made big
+    // enough for the longest period to begin with.
+    max_period_frames = specification.frames;
+    if (settings.adaptive_period && max_period_frames < MAX_PERIOD_FRAMES) {
+        max_period_frames = MAX_PERIOD_FRAMES;
+    }
+    u64 devicebound_size = format_byte_count(specification.format) *
+                           specification.channels * max_period_frames;
+    create_bus_graph(&bus_graph, specification.channels, max_period_frames);
+    mixed_samples = bus_graph.buses[static_cast<int>(Bus::Master)].samples;
+    devicebound_samples = nullptr;
+    if (needs_devicebound_buffer(&device)) {
+        devicebound_samples = ALLOCATE_LOCKABLE_ARRAY(u8, devicebound_size);
+    }
 
     conversion_info.channels = specification.channels;
     conversion_info.in.format = FORMAT_F32;
@@ -913,91 +3363,180 @@ static void* run_mixer_thread(void* argument) {
     conversion_info.out.format = specification.format;
     conversion_info.out.stride = conversion_info.channels;
 
-    int frame_size = conversion_info.channels *
-                     format_byte_count(conversion_info.out.format);
+    create_limiter(&limiter, specification.channels,
+                   specification.sample_rate);
+    set_bus_effect(&bus_graph, Bus::Master, process_limiter, &limiter);
+    reset_listener(&listener);
+
+    memory_locking = settings.lock_memory;
+    lock_memory(&stream_manager, sizeof stream_manager);
+    lock_memory(&message_queue, sizeof message_queue);
+    lock_memory(&schedule, sizeof schedule);
+    lock_memory(bus_graph.pool, sizeof(float) * BUS_COUNT *
+                                specification.channels * max_period_frames);
+    lock_memory(limiter.delay, sizeof(float) * 2 * LIMITER_LOOKAHEAD_FRAMES *
+                               specification.channels);
+    if (devicebound_samples) {
+        lock_memory(devicebound_samples, devicebound_size);
+    }
 
-    while (atomic_flag_test_and_set(&quit)) {
-        BEGIN_MONITORING(audio);
-
-        // Process any messages from the main thread.
-        {
-            Message message;
-            while (dequeue_message(&message_queue, &message)) {
-                switch (message.code) {
-                    case Message::Code::Play_Once: {
-                        open_stream(&stream_manager,
-                                    message.play_once.filename, samples,
-                                    message.play_once.volume, false);
-                        break;
-                    }
-                    case Message::Code::Start_Stream: {
-                        open_stream(&stream_manager,
-                                    message.start_stream.filename, samples,
-                                    message.start_stream.volume, true,
-                                    message.start_stream.stream_id);
-                        break;
-                    }
-                    case Message::Code::Stop_Stream: {
-                        close_stream_by_id(&stream_manager,
-                                           message.stop_stream.stream_id);
-                        break;
-                    }
-                }
-            }
-        }
+    CLEAR_STRUCT(&period_adapter);
+    reset_period_adapter(&period_adapter, device.xruns);
 
-        decode_streams(&stream_manager, specification.frames);
+    schedule.count = 0;
+    messages_held_back = false;
+    time = 0.0;
+    atomic_int_store(&clock_frames, 0);
+    CLEAR_STRUCT(&mixer_totals);
+    mixer_totals.start_time = get_wall_time();
 
-        fill_with_silence(mixed_samples, specification.silence, samples);
-        mix_streams(&stream_manager, mixed_samples,
-                    specification.frames, specification.channels);
+    return opened;
+}
 
-        convert_format(mixed_samples, devicebound_samples,
-                       specification.frames, &conversion_info);
-
-        int stream_ready = snd_pcm_wait(pcm_handle, 150);
-        if (!stream_ready) {
-            LOG_ERROR("ALSA device waiting timed out!");
-        }
-
-        u8* buffer = static_cast<u8*>(devicebound_samples);
-        snd_pcm_uframes_t frames_left = specification.frames;
-        while (frames_left > 0) {
-            int frames_written = snd_pcm_writei(pcm_handle, buffer,
-                                                frames_left);
-            if (frames_written < 0) {
-                int status = frames_written;
-                if (status == -EAGAIN) {
-                    continue;
-                }
-                status = snd_pcm_recover(pcm_handle, status, 0);
-                if (status < 0) {
-                    break;
-                }
-                continue;
+// Mixes the next period and hands it over to the device.
+static void mix_period() {
+    double delta_time = static_cast<double>(specification.frames) /
+                        static_cast<double>(specification.sample_rate);
+
+    // Each stage is timed separately, leaving out the time spent waiting on
+    // the device, so that only real work shows up.
+    double work_start = get_wall_time();
+
+    double stage_start = work_start;
+    u64 period_start = atomic_int_load(&clock_frames);
+    process_messages(period_start, specification.frames);
+    decode_streams(&stream_manager, specification.frames);
+    stage_start = end_stage(MixerStage::Decode, stage_start);
+
+    mix_streams(&stream_manager, &bus_graph, &listener, specification.frames);
+    double bus_start = get_wall_time();
+    mix_buses(&bus_graph, specification.frames);
+    mixer_totals.bus_time += get_wall_time() - bus_start;
+    double work_end = end_stage(MixerStage::Mix, stage_start);
+
+    double period_work = work_end - work_start;
+
+    wait_for_device(&device, &specification);
+
+    work_start = get_wall_time();
+
+    stage_start = work_start;
+    transfer_period(&device, mixed_samples, devicebound_samples,
+                    &specification, &conversion_info);
+    stage_start = end_stage(MixerStage::Output, stage_start);
+
+    decode_streams_ahead(&stream_manager, specification.frames);
+    work_end = end_stage(MixerStage::Decode_Ahead, stage_start);
+
+    // Doing more work each period than the period lasts means the device
+    // will eventually be starved, however much is buffered.
+    period_work += work_end - work_start;
+    mixer_totals.work_time += period_work;
+    if (period_work > mixer_totals.worst_work_time) {
+        mixer_totals.worst_work_time = period_work;
+    }
+    if (period_work > delta_time) {
+        mixer_totals.missed_deadlines += 1;
+        add_to_total(&mixer_monitor.missed_deadlines, 1);
+    }
+    mixer_totals.periods += 1;
+    add_to_total(&mixer_monitor.periods, 1);
+    mixer_totals.deadline = delta_time;
+
+    time += delta_time;
+    atomic_int_store(&clock_frames, period_start + specification.frames);
+
+    if (settings.adaptive_period) {
+        record_period_work(&period_adapter, period_work, delta_time);
+        u64 frames = adapt_period(&period_adapter, device.xruns,
+                                  specification.frames);
+        if (frames != specification.frames) {
+            u64 old_frames = specification.frames;
+            if (resize_device_period(&device, &specification, frames,
+                                     max_period_frames)) {
+                REPORT_DEBUG("Changed the audio period from %lu to %lu frames.",
+                             old_frames, specification.frames);
+                mixer_totals.period_changes += 1;
+                add_to_total(&mixer_monitor.period_changes, 1);
             }
-            buffer += frames_written * frame_size;
-            frames_left -= frames_written;
+            reset_period_adapter(&period_adapter, device.xruns);
         }
+    }
+}
 
-        double delta_time = static_cast<double>(specification.frames) /
-                            static_cast<double>(specification.sample_rate);
-        time += delta_time;
-
-        END_MONITORING(audio);
+// Reports how the mixing went, then closes the device and frees everything
+// set up by begin_mixing.
+static void end_mixing() {
+    // Without a real device to keep pace, report how quickly the mixer went
+    // so it can be used as a benchmark.
+    if (settings.backend != Backend::Alsa) {
+        double elapsed = get_wall_time() - mixer_totals.start_time;
+        if (elapsed > 0.0) {
+            REPORT_DEBUG("Mixed %f seconds of audio in %f seconds, %f times "
+                         "faster than real time.", time, elapsed,
+                         time / elapsed);
+        }
+    }
+    u64 periods = mixer_totals.periods;
+    if (periods > 0) {
+        REPORT_DEBUG("Mixing the buses took %f microseconds per period of %i "
+                     "frames.", 1.0e6 * mixer_totals.bus_time / periods,
+                     static_cast<int>(specification.frames));
+        REPORT_DEBUG("The limiter took %f microseconds per period of %i "
+                     "frames.", 1.0e6 * mixer_totals.limiter_time / periods,
+                     static_cast<int>(specification.frames));
+        REPORT_DEBUG("Each period took %f microseconds of work on average and "
+                     "%f at worst, against a deadline of %f.",
+                     1.0e6 * mixer_totals.work_time / periods,
+                     1.0e6 * mixer_totals.worst_work_time,
+                     1.0e6 * mixer_totals.deadline);
+        REPORT_DEBUG("Over %lu periods, %lu missed their deadline, with %lu "
+                     "underruns and %lu device wait timeouts.", periods,
+                     mixer_totals.missed_deadlines, device.xruns,
+                     device.wait_timeouts);
+    }
+    if (settings.adaptive_period) {
+        REPORT_DEBUG("The audio period changed size %lu times, finishing at %i "
+                     "frames.", mixer_totals.period_changes,
+                     static_cast<int>(specification.frames));
     }
 
     close_all_streams(&stream_manager);
+    destroy_asset_cache(&stream_manager.asset_cache);
 
     // Clear up mixer data.
-    close_device(pcm_handle);
-    DEALLOCATE_ARRAY(mixed_samples);
-    DEALLOCATE_ARRAY(devicebound_samples);
+    close_device(&device, &specification);
+    destroy_limiter(&limiter);
+    destroy_bus_graph(&bus_graph);
+    if (devicebound_samples) {
+        DEALLOCATE_LOCKABLE_ARRAY(devicebound_samples, u8,
+                                  format_byte_count(specification.format) *
+                                  specification.channels * max_period_frames);
+    }
+}
 
+static void* run_mixer_thread(void* argument) {
+    configure_mixer_thread();
+    begin_mixing();
+    while (atomic_flag_test_and_set(&quit)) {
+        mix_period();
+    }
+    end_mixing();
     return nullptr;
 }
 
-bool startup() {
+bool startup(const Settings* custom_settings) {
+    if (custom_settings) {
+        settings = *custom_settings;
+    } else {
+        settings.backend = Backend::Alsa;
+        settings.output_filename = nullptr;
+        settings.scheduling = Scheduling::Normal;
+        settings.lock_memory = false;
+        settings.cpu = -1;
+        settings.adaptive_period = false;
+    }
+
     atomic_flag_test_and_set(&quit);
     int result = pthread_create(&thread, nullptr, run_mixer_thread, nullptr);
     return result == 0;
@@ -1007,14 +3546,167 @@ void shutdown() {
     // Signal the mixer thread to quit and wait here for it to finish.
     atomic_flag_clear(&quit);
     pthread_join(thread, nullptr);
+    log_reports();
+}
+
+// Passes on one running total, if it's gone up since last time.
+static void publish_ticks(const char* name, AtomicInt* total,
+                          AtomicInt* published) {
+    long value = atomic_int_load(total);
+    if (value > *published) {
+        monitoring::add_ticks(name, value - *published);
+        *published = value;
+    }
+}
+
+void publish_reports() {
+    static const char* stage_names[MIXER_STAGE_COUNT] = {
+        "audio_decode", "audio_mix", "audio_output", "audio_decode_ahead",
+    };
+    MixerMonitor* published = &published_monitor;
+    long periods = atomic_int_load(&mixer_monitor.periods);
+    if (periods > published->periods) {
+        int count = periods - published->periods;
+        FOR_N(i, MIXER_STAGE_COUNT) {
+            long stage_time = atomic_int_load(mixer_monitor.stage_time + i);
+            monitoring::add_reading(stage_names[i],
+                                    stage_time - published->stage_time[i],
+                                    count);
+            published->stage_time[i] = stage_time;
+        }
+        published->periods = periods;
+    }
+    publish_ticks("audio_xruns", &mixer_monitor.xruns, &published->xruns);
+    publish_ticks("audio_wait_timeouts", &mixer_monitor.wait_timeouts,
+                  &published->wait_timeouts);
+    publish_ticks("audio_missed_deadlines", &mixer_monitor.missed_deadlines,
+                  &published->missed_deadlines);
+    publish_ticks("audio_period_changes", &mixer_monitor.period_changes,
+                  &published->period_changes);
+
+    log_reports();
+}
+
+// Folds a period of output into a running FNV-1a hash, a word at a time,
+// which is plenty for telling whether two renders came out the same.
+static u64 hash_period(u64 hash, const void* samples, u64 size) {
+    const u32* words = static_cast<const u32*>(samples);
+    FOR_N(i, size / sizeof(u32)) {
+        hash ^= words[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+bool render(const char* script_filename, const char* output_filename,
+            RenderReport* report) {
+    RenderScript script;
+    if (!load_render_script(&script, script_filename)) {
+        return false;
+    }
+
+    settings.backend = Backend::Wave_File;
+    settings.output_filename = output_filename;
+    settings.scheduling = Scheduling::Normal;
+    settings.lock_memory = false;
+    settings.cpu = -1;
+    settings.adaptive_period = false;
+    if (!begin_mixing()) {
+        end_mixing();
+        log_reports();
+        DEALLOCATE_ARRAY(script.messages);
+        return false;
+    }
+
+    u32 sample_rate = specification.sample_rate;
+    u64 end_frame = time_to_frame(script.end_time, sample_rate);
+    u64 hash = 0xcbf29ce484222325;
+    int next = 0;
+    while (true) {
+        u64 period_start = atomic_int_load(&clock_frames);
+        if (period_start >= end_frame) {
+            break;
+        }
+
+        // Hand over the commands due by the end of the period, like the main
+        // thread would, so they go through exactly the same path.
+        u64 period_end = period_start + specification.frames;
+        while (next < script.message_count) {
+            Message* message = script.messages + next;
+            if (time_to_frame(message->time, sample_rate) >= period_end ||
+                    !enqueue_message(&message_queue, message)) {
+                break;
+            }
+            next += 1;
+        }
+
+        mix_period();
+        hash = hash_period(hash, devicebound_samples, specification.size);
+
+        // Mixing happens on this thread, so whatever it reports can be logged
+        // straight away.
+        log_reports();
+    }
+
+    report->seconds_rendered = time;
+    report->seconds_taken = get_wall_time() - mixer_totals.start_time;
+    report->checksum = hash;
+
+    // Anything left over when the script ended early is dropped.
+    Message message;
+    while (dequeue_message(&message_queue, &message)) {}
+
+    end_mixing();
+    publish_reports();
+    DEALLOCATE_ARRAY(script.messages);
+
+    return true;
+}
+
+void play_once(const char* filename, float volume, Bus bus) {
+    Message message;
+    message.code = Message::Code::Play_Once;
+    message.time = 0.0;
+    copy_string(message.play_once.filename, filename,
+                sizeof message.play_once.filename);
+    message.play_once.volume = volume;
+    message.play_once.bus = static_cast<int>(bus);
+    message.play_once.positioned = false;
+    enqueue_message(&message_queue, &message);
+}
+
+void play_once_at(const char* filename, float volume, float x, float y,
+                  Bus bus) {
+    Message message;
+    message.code = Message::Code::Play_Once;
+    message.time = 0.0;
+    copy_string(message.play_once.filename, filename,
+                sizeof message.play_once.filename);
+    message.play_once.volume = volume;
+    message.play_once.bus = static_cast<int>(bus);
+    message.play_once.positioned = true;
+    message.play_once.x = x;
+    message.play_once.y = y;
+    enqueue_message(&message_queue, &message);
+}
+
+double get_time() {
+    long frames = atomic_int_load(&clock_frames);
+    if (frames == 0) {
+        return 0.0;
+    }
+    return static_cast<double>(frames) / specification.sample_rate;
 }
 
-void play_once(const char* filename, float volume) {
+void schedule_once(const char* filename, float volume, double time, Bus bus) {
     Message message;
     message.code = Message::Code::Play_Once;
+    message.time = time;
     copy_string(message.play_once.filename, filename,
                 sizeof message.play_once.filename);
     message.play_once.volume = volume;
+    message.play_once.bus = static_cast<int>(bus);
+    message.play_once.positioned = false;
     enqueue_message(&message_queue, &message);
 }
 
@@ -1029,15 +3721,17 @@ static StreamId generate_stream_id() {
 }
 
 void start_stream(const char* filename, float volume,
-                  StreamId* out_stream_id) {
+                  StreamId* out_stream_id, Bus bus) {
     StreamId stream_id = generate_stream_id();
 
     Message message;
     message.code = Message::Code::Start_Stream;
+    message.time = 0.0;
     copy_string(message.start_stream.filename, filename,
                 sizeof message.start_stream.filename);
     message.start_stream.stream_id = stream_id;
     message.start_stream.volume = volume;
+    message.start_stream.bus = static_cast<int>(bus);
     enqueue_message(&message_queue, &message);
 
     *out_stream_id = stream_id;
@@ -1046,8 +3740,78 @@ void start_stream(const char* filename, float volume,
 void stop_stream(StreamId stream_id) {
     Message message;
     message.code = Message::Code::Stop_Stream;
+    message.time = 0.0;
     message.stop_stream.stream_id = stream_id;
     enqueue_message(&message_queue, &message);
 }
 
+void set_loop(StreamId stream_id, unsigned int start_frame,
+              unsigned int end_frame, double time) {
+    Message message;
+    message.code = Message::Code::Set_Loop;
+    message.time = time;
+    message.set_loop.stream_id = stream_id;
+    message.set_loop.start_frame = start_frame;
+    message.set_loop.end_frame = end_frame;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_volume(StreamId stream_id, float volume, double fade_time,
+                Fade fade, double time) {
+    Message message;
+    message.code = Message::Code::Set_Volume;
+    message.time = time;
+    message.set_volume.stream_id = stream_id;
+    message.set_volume.volume = volume;
+    message.set_volume.fade_time = fade_time;
+    message.set_volume.fade = fade;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_stream_position(StreamId stream_id, float x, float y) {
+    Message message;
+    message.code = Message::Code::Set_Position;
+    message.time = 0.0;
+    message.set_position.stream_id = stream_id;
+    message.set_position.x = x;
+    message.set_position.y = y;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_listener_position(float x, float y) {
+    Message message;
+    message.code = Message::Code::Set_Listener;
+    message.time = 0.0;
+    message.set_listener.x = x;
+    message.set_listener.y = y;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_distance_falloff(float reference_distance, float rolloff) {
+    Message message;
+    message.code = Message::Code::Set_Falloff;
+    message.time = 0.0;
+    message.set_falloff.reference_distance = reference_distance;
+    message.set_falloff.rolloff = rolloff;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_bus_gain(Bus bus, float gain) {
+    Message message;
+    message.code = Message::Code::Set_Bus_Gain;
+    message.time = 0.0;
+    message.set_bus_gain.bus = static_cast<int>(bus);
+    message.set_bus_gain.gain = gain;
+    enqueue_message(&message_queue, &message);
+}
+
+void set_bus_mute(Bus bus, bool mute) {
+    Message message;
+    message.code = Message::Code::Set_Bus_Mute;
+    message.time = 0.0;
+    message.set_bus_mute.bus = static_cast<int>(bus);
+    message.set_bus_mute.mute = mute;
+    enqueue_message(&message_queue, &message);
+}
+
 } // namespace audio
@@ -4,11 +4,94 @@ namespace audio {
 
 typedef unsigned int StreamId;
 
-bool startup();
+enum class Backend {
+    Alsa,             // plays through the default ALSA device
+    Null,             // discards the output, paced like a real device
+    Null_Unthrottled, // discards the output, mixing as fast as possible
+    Wave_File,        // writes the output to a .wav file, as fast as possible
+};
+
+enum class Scheduling {
+    Normal,
+    Fifo,        // SCHED_FIFO, if the process is allowed it
+    Round_Robin, // SCHED_RR, if the process is allowed it
+};
+
+struct Settings {
+    Backend backend;
+    const char* output_filename; // only used by Backend::Wave_File
+    Scheduling scheduling; // for the mixer thread
+    bool lock_memory; // keep the mixer's buffers from being paged out
+    int cpu; // the CPU to run the mixer thread on, or -1 for any
+    bool adaptive_period; // find the shortest period that doesn't underrun
+};
+
+// Streams are mixed into one of these buses, and every bus other than the
+// master is mixed into the master bus, so that a whole group of sounds can be
+// turned down or muted at once.
+enum class Bus {
+    Master,
+    Music,
+    Sound_Effects,
+    Ambience,
+    Interface,
+};
+
+enum class Fade {
+    Linear,
+    Exponential, // even steps in decibels, down to -60dB
+};
+
+bool startup(const Settings* settings = nullptr);
 void shutdown();
-void play_once(const char* filename, float volume);
 
-void start_stream(const char* filename, float volume, StreamId* stream_id);
+// The mixer thread doesn't touch monitoring or the log itself, so that it
+// never has to wait on another thread. This hands what it's measured over to
+// monitoring and logs anything it's reported, and should be called once a
+// frame on the main thread.
+void publish_reports();
+
+struct RenderReport {
+    double seconds_rendered;
+    double seconds_taken;
+    unsigned long long checksum; // of every sample written, to compare runs
+};
+
+// Mixes a script of timed commands straight into a .wav file on the calling
+// thread, as fast as possible and without a device, so that the results are
+// the same every time. This can't be used while the audio system is started.
+// The script format is described where it's read in audio.cpp.
+bool render(const char* script_filename, const char* output_filename,
+            RenderReport* report);
+void play_once(const char* filename, float volume,
+               Bus bus = Bus::Sound_Effects);
+
+void start_stream(const char* filename, float volume, StreamId* stream_id,
+                  Bus bus = Bus::Music);
 void stop_stream(StreamId stream_id);
 
+// The audio clock is the time in seconds of the next frame to be mixed.
+// Anything scheduled for a time which has already passed happens as soon as
+// possible.
+double get_time();
+void schedule_once(const char* filename, float volume, double time,
+                   Bus bus = Bus::Sound_Effects);
+// Loop points are in frames. An end of zero loops at the end of the stream.
+void set_loop(StreamId stream_id, unsigned int start_frame,
+              unsigned int end_frame = 0, double time = 0.0);
+void set_volume(StreamId stream_id, float volume, double fade_time = 0.0,
+                Fade fade = Fade::Linear, double time = 0.0);
+
+// Positioned streams are panned and attenuated by where they are relative to
+// the listener, in world units. Sounds within the reference distance play at
+// full volume, and fall off beyond it at a rate set by the rolloff.
+void play_once_at(const char* filename, float volume, float x, float y,
+                  Bus bus = Bus::Sound_Effects);
+void set_stream_position(StreamId stream_id, float x, float y);
+void set_listener_position(float x, float y);
+void set_distance_falloff(float reference_distance, float rolloff);
+
+void set_bus_gain(Bus bus, float gain);
+void set_bus_mute(Bus bus, bool mute);
+
 } // namespace audio
@@ -0,0 +1,68 @@
+#include "file_mapping.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+bool map_file(FileMapping* mapping, const char* filename) {
+    mapping->data = nullptr;
+    mapping->size = 0;
+    mapping->owned = false;
+
+    int file = open(filename, O_RDONLY);
+    if (file == -1) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) == -1 || status.st_size <= 0) {
+        // Empty files can't be mapped, and there would be nothing to read
+        // from them anyway.
+        close(file);
+        return false;
+    }
+
+    std::size_t size = status.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+
+    // The mapping keeps its own reference to the file, so the descriptor
+    // isn't needed any longer whether or not it succeeded.
+    close(file);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    mapping->data = data;
+    mapping->size = size;
+    mapping->owned = true;
+    return true;
+}
+
+void unmap_file(FileMapping* mapping) {
+    // A view into some other mapping is only let go of, since it's not this
+    // one's to unmap.
+    if (mapping->data && mapping->owned) {
+        munmap(mapping->data, mapping->size);
+    }
+    mapping->data = nullptr;
+    mapping->size = 0;
+    mapping->owned = false;
+}
+
+void advise_mapping(FileMapping* mapping, MappingAccess access) {
+    int advice = MADV_NORMAL;
+    switch (access) {
+        case MappingAccess::Sequential: {
+            advice = MADV_SEQUENTIAL;
+            break;
+        }
+        case MappingAccess::Soon: {
+            advice = MADV_WILLNEED;
+            break;
+        }
+    }
+    // This is only ever a hint, so it doesn't matter if it's not taken.
+    madvise(mapping->data, mapping->size, advice);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+// A read-only view of a whole file's contents mapped into memory.
+struct FileMapping {
+    void* data;
+    std::size_t size;
+    bool owned; // false for a view into another mapping, like an asset pack
+};
+
+// Hints about how a mapping is about to be read, so the pages can be brought
+// in before they're touched.
+enum class MappingAccess {
+    Sequential, // read through from start to finish, once
+    Soon,       // the whole file is going to be wanted shortly
+};
+
+bool map_file(FileMapping* mapping, const char* filename);
+void unmap_file(FileMapping* mapping);
+void advise_mapping(FileMapping* mapping, MappingAccess access);
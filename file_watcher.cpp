@@ -0,0 +1,114 @@
+#include "file_watcher.h"
+
+#include "logging.h"
+#include "string_utilities.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cstring>
+
+bool create_file_watcher(FileWatcher* watcher) {
+    watcher->file_count = 0;
+    watcher->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify == -1) {
+        LOG_ERROR("Couldn't start watching for files changing.");
+        return false;
+    }
+    return true;
+}
+
+void destroy_file_watcher(FileWatcher* watcher) {
+    // Closing the instance stops every watch it had.
+    if (watcher->inotify != -1) {
+        close(watcher->inotify);
+        watcher->inotify = -1;
+    }
+    watcher->file_count = 0;
+}
+
+int watch_file(FileWatcher* watcher, const char* path) {
+    if (watcher->file_count >= MAX_WATCHED_FILES) {
+        LOG_ERROR("Too many files are being watched to watch %s.", path);
+        return -1;
+    }
+
+    char directory[256] = {};
+    const char* name = path;
+    const char* slash = std::strrchr(path, '/');
+    if (slash) {
+        std::size_t directory_size = slash - path;
+        if (directory_size >= sizeof directory) {
+            LOG_ERROR("The path %s is too long to watch.", path);
+            return -1;
+        }
+        if (directory_size == 0) {
+            copy_string(directory, "/", sizeof directory);
+        } else {
+            copy_string(directory, path, directory_size + 1);
+        }
+        name = slash + 1;
+    } else {
+        copy_string(directory, ".", sizeof directory);
+    }
+    FileWatcher::File* file = &watcher->files[watcher->file_count];
+    if (string_size(name) >= sizeof file->name) {
+        LOG_ERROR("The file name %s is too long to watch.", name);
+        return -1;
+    }
+
+    // Watching a directory twice gives back the same watch, so files in the
+    // same directory share one.
+    int watch = inotify_add_watch(watcher->inotify, directory,
+                                  IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch == -1) {
+        LOG_ERROR("Couldn't watch the directory %s for changes.", directory);
+        return -1;
+    }
+
+    copy_string(file->name, name, sizeof file->name);
+    file->watch = watch;
+    file->changed = false;
+    int index = watcher->file_count;
+    watcher->file_count += 1;
+    return index;
+}
+
+bool check_watched_files(FileWatcher* watcher) {
+    bool any_changed = false;
+    alignas(inotify_event) char buffer[4096];
+    for (;;) {
+        ssize_t size = read(watcher->inotify, buffer, sizeof buffer);
+        if (size <= 0) {
+            // There's nothing more to read for now.
+            break;
+        }
+        for (ssize_t i = 0; i < size;) {
+            const inotify_event* event =
+                reinterpret_cast<const inotify_event*>(buffer + i);
+            i += sizeof *event + event->len;
+
+            // If too much happened at once for all of it to be told, anything
+            // could have changed.
+            bool overflowed = event->mask & IN_Q_OVERFLOW;
+            for (int j = 0; j < watcher->file_count; ++j) {
+                FileWatcher::File* file = &watcher->files[j];
+                if (overflowed || (event->len > 0 && event->wd == file->watch &&
+                        strings_match(event->name, file->name))) {
+                    file->changed = true;
+                    any_changed = true;
+                }
+            }
+        }
+    }
+    return any_changed;
+}
+
+bool file_changed(FileWatcher* watcher, int file) {
+    if (file < 0) {
+        return false;
+    }
+    bool changed = watcher->files[file].changed;
+    watcher->files[file].changed = false;
+    return changed;
+}
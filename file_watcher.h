@@ -0,0 +1,34 @@
+#pragma once
+
+// Watches files for being written to, so that assets can be loaded again
+// while the game's running. It's the directories which are watched rather than
+// the files themselves, so files saved by writing a new one and renaming it
+// over the old, like many editors do, are still seen to change.
+
+#define MAX_WATCHED_FILES 16
+
+struct FileWatcher {
+    struct File {
+        char name[64]; // within its directory
+        int watch;
+        bool changed;
+    };
+
+    File files[MAX_WATCHED_FILES];
+    int file_count;
+    int inotify;
+};
+
+bool create_file_watcher(FileWatcher* watcher);
+void destroy_file_watcher(FileWatcher* watcher);
+
+// Gives the index to ask whether the file changed with, or -1 if it can't be
+// watched. Asking about -1 only ever says it's not changed.
+int watch_file(FileWatcher* watcher, const char* path);
+
+// Checks for any changes since the last check, without waiting for one, and
+// says whether any watched file changed.
+bool check_watched_files(FileWatcher* watcher);
+
+// Says whether the file changed as of the last check, and forgets that it did.
+bool file_changed(FileWatcher* watcher, int file);
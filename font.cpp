@@ -1,5 +1,7 @@
 #include "font.h"
 
+#include "asset_pack.h"
+
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -112,21 +114,6 @@ static int kerning_table_insert(BmFont::KerningPair* table, int table_count,
     return probe;
 }
 
-static int kerning_table_search(BmFont::KerningPair* table, int table_count,
-                                char32_t a, char32_t b) {
-    int probe = hash_pair(a, b, table_count);
-    for (int i = 0; i < table_count; ++i) {
-        if (table[probe].first == INVALID_CODEPOINT) {
-            break;
-        }
-        if (table[probe].first == a && table[probe].second == b) {
-            return probe;
-        }
-        wrap_increment(&probe, table_count);
-    }
-    return -1;
-}
-
 // Text File Reader Functions..................................................
 
 struct Reader {
@@ -166,34 +153,282 @@ static std::size_t get_attribute_size(Reader* reader) {
     return std::strcspn(reader->current, " \n");
 }
 
-// BmFont Functions............................................................
+// Glyph Lookup Functions......................................................
+//     These tables are built once a font's loaded, so that the lookups done
+//     for every character drawn are cheap. Codepoints below 256 index
+//     straight into an array. The rest go through a minimal perfect hash,
+//     built by hash and displace, so any glyph is found with a single probe.
+//     Kerning pairs are grouped into a run for each first glyph, sorted by
+//     the second codepoint, so only that glyph's few pairs get searched.
 
-bool bm_font_load(BmFont* font, const char* filename) {
-    font->tracking = 0;
+static inline uint32_t hash_seeded(uint32_t seed, char32_t c) {
+    return hash_bj6(c ^ (seed * 0x9E3779B9u));
+}
 
-    // Fetch the whole .fnt file and copy the contents into memory.
+struct HashBucket {
+    int index;
+    int size;
+};
 
-    std::FILE* file = std::fopen(filename, "r");
-    if (!file) {
-        return false;
+static int compare_bucket_sizes(const void* a, const void* b) {
+    const HashBucket* first = static_cast<const HashBucket*>(a);
+    const HashBucket* second = static_cast<const HashBucket*>(b);
+    if (first->size != second->size) {
+        return second->size - first->size;
     }
+    return first->index - second->index;
+}
 
-    std::fseek(file, 0, SEEK_END);
-    long int total_bytes = std::ftell(file);
-    std::fseek(file, 0, SEEK_SET);
+// Hashes each key to a bucket, then, biggest bucket first, finds a seed which
+// sends every key in the bucket to a free slot. Buckets of one key just get
+// put in whichever slot's left, which is stored as a negative displacement.
+static bool build_perfect_hash(BmFont::Lookup* lookup, char32_t* codepoints,
+                               int* keys, int n) {
+    lookup->slot_count = n;
+    lookup->displacements = ALLOCATE(int, n);
+    lookup->slots = ALLOCATE(int, n);
+    int* members = ALLOCATE(int, n);
+    int* starts = ALLOCATE(int, n + 1);
+    HashBucket* buckets = ALLOCATE(HashBucket, n);
+    int* chosen = ALLOCATE(int, n);
+
+    for (int i = 0; i < n; ++i) {
+        lookup->displacements[i] = 0;
+        lookup->slots[i] = -1;
+        buckets[i].index = i;
+        buckets[i].size = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        buckets[hash_seeded(0, codepoints[keys[i]]) % n].size += 1;
+    }
+    starts[0] = 0;
+    for (int i = 0; i < n; ++i) {
+        starts[i + 1] = starts[i] + buckets[i].size;
+    }
+    for (int i = 0; i < n; ++i) {
+        int bucket = hash_seeded(0, codepoints[keys[i]]) % n;
+        int filled = starts[bucket + 1] - buckets[bucket].size;
+        members[filled] = keys[i];
+        buckets[bucket].size -= 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        buckets[i].size = starts[i + 1] - starts[i];
+    }
+    std::qsort(buckets, n, sizeof *buckets, compare_bucket_sizes);
+
+    bool built = true;
+    int next_free = 0;
+    for (int i = 0; i < n && built; ++i) {
+        HashBucket* bucket = buckets + i;
+        int* bucket_keys = members + starts[bucket->index];
+        if (bucket->size == 0) {
+            break;
+        } else if (bucket->size == 1) {
+            while (lookup->slots[next_free] != -1) {
+                next_free += 1;
+            }
+            lookup->slots[next_free] = bucket_keys[0];
+            lookup->displacements[bucket->index] = -next_free - 1;
+            continue;
+        }
 
-    char* data = ALLOCATE(char, total_bytes + 1);
-    if (!data) {
-        std::fclose(file);
-        return false;
+        // Keep trying seeds until one puts all the keys in free slots that
+        // are different from one another.
+        bool placed = false;
+        for (uint32_t seed = 1; !placed && seed < 0x100000; ++seed) {
+            placed = true;
+            for (int j = 0; j < bucket->size && placed; ++j) {
+                int slot = hash_seeded(seed, codepoints[bucket_keys[j]]) % n;
+                placed = lookup->slots[slot] == -1;
+                for (int k = 0; k < j && placed; ++k) {
+                    placed = chosen[k] != slot;
+                }
+                chosen[j] = slot;
+            }
+            if (placed) {
+                for (int j = 0; j < bucket->size; ++j) {
+                    lookup->slots[chosen[j]] = bucket_keys[j];
+                }
+                lookup->displacements[bucket->index] = seed;
+            }
+        }
+        built = placed;
     }
-    data[total_bytes] = '\0';
 
-    std::size_t read_count = std::fread(data, total_bytes, 1, file);
-    std::fclose(file);
-    if (read_count != 1) {
-        DEALLOCATE(data);
-        return false;
+    DEALLOCATE(members);
+    DEALLOCATE(starts);
+    DEALLOCATE(buckets);
+    DEALLOCATE(chosen);
+
+    if (!built) {
+        DEALLOCATE(lookup->displacements);
+        DEALLOCATE(lookup->slots);
+        lookup->displacements = nullptr;
+        lookup->slots = nullptr;
+    }
+    return built;
+}
+
+static int find_glyph(BmFont* font, char32_t c) {
+    const BmFont::Lookup* lookup = &font->lookup;
+    if (c < 256) {
+        return lookup->latin1[c];
+    }
+    int n = lookup->slot_count;
+    if (n == 0) {
+        return -1;
+    }
+    if (!lookup->displacements) {
+        // The perfect hash couldn't be built, so fall back to probing.
+        return character_map_search(font->character_map, font->num_glyphs, c);
+    }
+    int displacement = lookup->displacements[hash_seeded(0, c) % n];
+    int slot;
+    if (displacement < 0) {
+        slot = -displacement - 1;
+    } else {
+        slot = hash_seeded(displacement, c) % n;
+    }
+    int glyph = lookup->slots[slot];
+    if (font->character_map[glyph] != c) {
+        return -1;
+    }
+    return glyph;
+}
+
+static void build_kerning_runs(BmFont* font) {
+    BmFont::Lookup* lookup = &font->lookup;
+    int* runs = ALLOCATE(int, font->num_glyphs + 1);
+    for (int i = 0; i <= font->num_glyphs; ++i) {
+        runs[i] = 0;
+    }
+
+    // Count each glyph's pairs, then turn the counts into where each run
+    // starts, leaving one past the end of the last run at the end.
+    for (int i = 0; i < font->num_kerning_pairs; ++i) {
+        BmFont::KerningPair* pair = font->kerning_table + i;
+        int glyph = -1;
+        if (pair->first != INVALID_CODEPOINT) {
+            glyph = find_glyph(font, pair->first);
+        }
+        if (glyph >= 0) {
+            runs[glyph + 1] += 1;
+        }
+    }
+    for (int i = 0; i < font->num_glyphs; ++i) {
+        runs[i + 1] += runs[i];
+    }
+    int entry_count = runs[font->num_glyphs];
+    BmFont::KerningEntry* entries = ALLOCATE(BmFont::KerningEntry,
+                                             entry_count);
+
+    // Put each pair in its run, in order of the second codepoint. The runs
+    // are short, so sorting them as they fill is fine.
+    int* ends = ALLOCATE(int, font->num_glyphs);
+    for (int i = 0; i < font->num_glyphs; ++i) {
+        ends[i] = runs[i];
+    }
+    for (int i = 0; i < font->num_kerning_pairs; ++i) {
+        BmFont::KerningPair* pair = font->kerning_table + i;
+        int glyph = -1;
+        if (pair->first != INVALID_CODEPOINT) {
+            glyph = find_glyph(font, pair->first);
+        }
+        if (glyph < 0) {
+            continue;
+        }
+        int j = ends[glyph];
+        for (; j > runs[glyph] && entries[j - 1].second > pair->second; --j) {
+            entries[j] = entries[j - 1];
+        }
+        entries[j].second = pair->second;
+        entries[j].amount = pair->amount;
+        ends[glyph] += 1;
+    }
+    DEALLOCATE(ends);
+
+    lookup->kerning_runs = runs;
+    lookup->kerning_entries = entries;
+}
+
+static void build_lookup(BmFont* font) {
+    BmFont::Lookup* lookup = &font->lookup;
+    for (int i = 0; i < 256; ++i) {
+        lookup->latin1[i] = -1;
+    }
+
+    int* keys = ALLOCATE(int, font->num_glyphs);
+    int key_count = 0;
+    for (int i = 0; i < font->num_glyphs; ++i) {
+        char32_t c = font->character_map[i];
+        if (c < 256) {
+            lookup->latin1[c] = i;
+        } else if (c != INVALID_CODEPOINT) {
+            keys[key_count] = i;
+            key_count += 1;
+        }
+    }
+    lookup->displacements = nullptr;
+    lookup->slots = nullptr;
+    lookup->slot_count = key_count;
+    if (key_count > 0) {
+        build_perfect_hash(lookup, font->character_map, keys, key_count);
+    }
+    DEALLOCATE(keys);
+
+    build_kerning_runs(font);
+}
+
+static void destroy_lookup(BmFont* font) {
+    DEALLOCATE(font->lookup.displacements);
+    DEALLOCATE(font->lookup.slots);
+    DEALLOCATE(font->lookup.kerning_runs);
+    DEALLOCATE(font->lookup.kerning_entries);
+}
+
+// BmFont Functions............................................................
+
+bool bm_font_load(BmFont* font, const char* filename) {
+    font->tracking = 0;
+    font->mapping.data = nullptr;
+    font->mapping.size = 0;
+    font->mapping.owned = false;
+
+    // Fetch the whole .fnt file and copy the contents into memory, from the
+    // asset pack if it's in there.
+
+    char* data;
+    FileMapping packed;
+    if (find_packed_file(&packed, filename)) {
+        data = ALLOCATE(char, packed.size + 1);
+        if (!data) {
+            return false;
+        }
+        std::memcpy(data, packed.data, packed.size);
+        data[packed.size] = '\0';
+    } else {
+        std::FILE* file = std::fopen(filename, "r");
+        if (!file) {
+            return false;
+        }
+
+        std::fseek(file, 0, SEEK_END);
+        long int total_bytes = std::ftell(file);
+        std::fseek(file, 0, SEEK_SET);
+
+        data = ALLOCATE(char, total_bytes + 1);
+        if (!data) {
+            std::fclose(file);
+            return false;
+        }
+        data[total_bytes] = '\0';
+
+        std::size_t read_count = std::fread(data, total_bytes, 1, file);
+        std::fclose(file);
+        if (read_count != 1) {
+            DEALLOCATE(data);
+            return false;
+        }
     }
 
     Reader reader = {};
@@ -288,20 +523,225 @@ bool bm_font_load(BmFont* font, const char* filename) {
         return false;
     }
 
+    build_lookup(font);
+
     return true;
 }
 
 void bm_font_unload(BmFont* font) {
+    if (font->mapping.data) {
+        unmap_file(&font->mapping);
+        return;
+    }
+    destroy_lookup(font);
     DEALLOCATE(font->kerning_table);
     DEALLOCATE(font->glyphs);
     DEALLOCATE(font->character_map);
     DEALLOCATE(font->image.filename);
 }
 
+// Compiled Font Functions.....................................................
+//     A compiled font holds the tables a font has once it's loaded, lookups
+//     and all, so loading one is just mapping it in and pointing at them.
+//     Every field is four bytes, in the byte order of the machine which
+//     compiled it. After the header come the sections, in the order they're
+//     listed below. The kerning pairs are only kept as the lookup's runs.
+
+#define COMPILED_FONT_MAGIC 0x43464D42 // "BMFC" in little-endian order
+#define COMPILED_FONT_VERSION 2
+
+enum CompiledSection {
+    SECTION_CHARACTER_MAP,   // char32_t[glyph_count], laid out as a hash map
+    SECTION_GLYPHS,          // BmFont::Glyph[glyph_count], lined up with it
+    SECTION_LATIN1,          // int[256]
+    SECTION_DISPLACEMENTS,   // int[slot_count], or none if it couldn't be built
+    SECTION_SLOTS,           // int[slot_count]
+    SECTION_KERNING_RUNS,    // int[glyph_count + 1]
+    SECTION_KERNING_ENTRIES, // BmFont::KerningEntry[]
+    SECTION_IMAGE_FILENAME,  // nul-terminated
+    SECTION_COUNT,
+};
+
+struct CompiledFontHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t size;
+    int32_t baseline;
+    int32_t leading;
+    int32_t scale_horizontal;
+    int32_t scale_vertical;
+    uint32_t glyph_count;
+    uint32_t slot_count;
+    struct {
+        uint32_t offset; // from the start of the file
+        uint32_t size; // in bytes
+    } sections[SECTION_COUNT];
+};
+
+static_assert(sizeof(char32_t) == 4 && sizeof(BmFont::Glyph) == 28 &&
+              sizeof(BmFont::KerningEntry) == 8,
+              "The tables of a compiled font are used in place, so their "
+              "layout has to match the file's.");
+
+bool bm_font_compile(BmFont* font, const char* filename) {
+    BmFont::Lookup* lookup = &font->lookup;
+    int glyph_count = font->num_glyphs;
+    int entry_count = lookup->kerning_runs[glyph_count];
+
+    CompiledFontHeader header;
+    header.magic = COMPILED_FONT_MAGIC;
+    header.version = COMPILED_FONT_VERSION;
+    header.size = font->size;
+    header.baseline = font->baseline;
+    header.leading = font->leading;
+    header.scale_horizontal = font->scale_horizontal;
+    header.scale_vertical = font->scale_vertical;
+    header.glyph_count = glyph_count;
+    header.slot_count = lookup->slot_count;
+
+    const void* contents[SECTION_COUNT];
+    std::size_t sizes[SECTION_COUNT];
+    contents[SECTION_CHARACTER_MAP] = font->character_map;
+    sizes[SECTION_CHARACTER_MAP] = sizeof(char32_t) * glyph_count;
+    contents[SECTION_GLYPHS] = font->glyphs;
+    sizes[SECTION_GLYPHS] = sizeof(BmFont::Glyph) * glyph_count;
+    contents[SECTION_LATIN1] = lookup->latin1;
+    sizes[SECTION_LATIN1] = sizeof lookup->latin1;
+    contents[SECTION_DISPLACEMENTS] = lookup->displacements;
+    sizes[SECTION_DISPLACEMENTS] = 0;
+    if (lookup->displacements) {
+        sizes[SECTION_DISPLACEMENTS] = sizeof(int) * lookup->slot_count;
+    }
+    contents[SECTION_SLOTS] = lookup->slots;
+    sizes[SECTION_SLOTS] = sizes[SECTION_DISPLACEMENTS];
+    contents[SECTION_KERNING_RUNS] = lookup->kerning_runs;
+    sizes[SECTION_KERNING_RUNS] = sizeof(int) * (glyph_count + 1);
+    contents[SECTION_KERNING_ENTRIES] = lookup->kerning_entries;
+    sizes[SECTION_KERNING_ENTRIES] = sizeof(BmFont::KerningEntry) *
+                                     entry_count;
+    contents[SECTION_IMAGE_FILENAME] = font->image.filename;
+    sizes[SECTION_IMAGE_FILENAME] = std::strlen(font->image.filename) + 1;
+
+    uint32_t offset = sizeof header;
+    for (int i = 0; i < SECTION_COUNT; ++i) {
+        header.sections[i].offset = offset;
+        header.sections[i].size = sizes[i];
+        offset += sizes[i];
+    }
+
+    std::FILE* file = std::fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = std::fwrite(&header, sizeof header, 1, file) == 1;
+    for (int i = 0; i < SECTION_COUNT && written; ++i) {
+        written = std::fwrite(contents[i], 1, sizes[i], file) == sizes[i];
+    }
+    if (std::fclose(file) != 0) {
+        written = false;
+    }
+    return written;
+}
+
+bool bm_font_load_compiled(BmFont* font, const char* filename) {
+    // Out of an asset pack, the tables are used right where they are in it.
+    FileMapping mapping;
+    if (!find_packed_file(&mapping, filename) &&
+            !map_file(&mapping, filename)) {
+        return false;
+    }
+
+    const CompiledFontHeader* header =
+        static_cast<const CompiledFontHeader*>(mapping.data);
+    if (mapping.size < sizeof *header ||
+            header->magic != COMPILED_FONT_MAGIC ||
+            header->version != COMPILED_FONT_VERSION) {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    // Check every section is the size it should be and lies within the
+    // file, so that a damaged file can't lead to reading past the end of the
+    // mapping.
+    std::size_t glyph_count = header->glyph_count;
+    std::size_t slot_count = header->slot_count;
+    std::size_t hash_size = header->sections[SECTION_DISPLACEMENTS].size;
+    std::size_t expected[SECTION_COUNT];
+    expected[SECTION_CHARACTER_MAP] = sizeof(char32_t) * glyph_count;
+    expected[SECTION_GLYPHS] = sizeof(BmFont::Glyph) * glyph_count;
+    expected[SECTION_LATIN1] = sizeof font->lookup.latin1;
+    expected[SECTION_DISPLACEMENTS] = hash_size;
+    expected[SECTION_SLOTS] = hash_size;
+    expected[SECTION_KERNING_RUNS] = sizeof(int) * (glyph_count + 1);
+    expected[SECTION_KERNING_ENTRIES] =
+        header->sections[SECTION_KERNING_ENTRIES].size;
+    expected[SECTION_IMAGE_FILENAME] =
+        header->sections[SECTION_IMAGE_FILENAME].size;
+
+    const uint8_t* base = static_cast<const uint8_t*>(mapping.data);
+    bool fits = (hash_size == 0 || hash_size == sizeof(int) * slot_count) &&
+                expected[SECTION_KERNING_ENTRIES] %
+                    sizeof(BmFont::KerningEntry) == 0 &&
+                expected[SECTION_IMAGE_FILENAME] > 0;
+    for (int i = 0; i < SECTION_COUNT && fits; ++i) {
+        std::size_t offset = header->sections[i].offset;
+        std::size_t size = header->sections[i].size;
+        fits = size == expected[i] && offset % 4 == 0 &&
+               offset <= mapping.size && size <= mapping.size - offset;
+    }
+    if (fits) {
+        const auto& filename_section = header->sections[SECTION_IMAGE_FILENAME];
+        fits = base[filename_section.offset + filename_section.size - 1] == '\0';
+    }
+    if (!fits) {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    // The mapping is read-only, and these are only ever read from.
+    uint8_t* contents[SECTION_COUNT];
+    for (int i = 0; i < SECTION_COUNT; ++i) {
+        contents[i] = const_cast<uint8_t*>(base + header->sections[i].offset);
+    }
+    font->size = header->size;
+    font->baseline = header->baseline;
+    font->tracking = 0;
+    font->leading = header->leading;
+    font->scale_horizontal = header->scale_horizontal;
+    font->scale_vertical = header->scale_vertical;
+    font->num_glyphs = glyph_count;
+    font->character_map =
+        reinterpret_cast<char32_t*>(contents[SECTION_CHARACTER_MAP]);
+    font->glyphs = reinterpret_cast<BmFont::Glyph*>(contents[SECTION_GLYPHS]);
+    font->image.filename =
+        reinterpret_cast<char*>(contents[SECTION_IMAGE_FILENAME]);
+    font->kerning_table = nullptr;
+    font->num_kerning_pairs = 0;
+
+    BmFont::Lookup* lookup = &font->lookup;
+    std::memcpy(lookup->latin1, contents[SECTION_LATIN1],
+                sizeof lookup->latin1);
+    lookup->slot_count = slot_count;
+    lookup->displacements = nullptr;
+    lookup->slots = nullptr;
+    if (hash_size > 0) {
+        lookup->displacements =
+            reinterpret_cast<int*>(contents[SECTION_DISPLACEMENTS]);
+        lookup->slots = reinterpret_cast<int*>(contents[SECTION_SLOTS]);
+    }
+    lookup->kerning_runs =
+        reinterpret_cast<int*>(contents[SECTION_KERNING_RUNS]);
+    lookup->kerning_entries = reinterpret_cast<BmFont::KerningEntry*>(
+        contents[SECTION_KERNING_ENTRIES]);
+    font->mapping = mapping;
+
+    return true;
+}
+
 // Font usage functions........................................................
 
 BmFont::Glyph* bm_font_get_character_mapping(BmFont* font, char32_t c) {
-    int index = character_map_search(font->character_map, font->num_glyphs, c);
+    int index = find_glyph(font, c);
     if (index >= 0) {
         return font->glyphs + index;
     }
@@ -309,10 +749,26 @@ BmFont::Glyph* bm_font_get_character_mapping(BmFont* font, char32_t c) {
 }
 
 int bm_font_get_kerning(BmFont* font, char32_t first, char32_t second) {
-    int index = kerning_table_search(font->kerning_table,
-                                     font->num_kerning_pairs, first, second);
-    if (index >= 0) {
-        return font->kerning_table[index].amount;
+    int glyph = find_glyph(font, first);
+    if (glyph < 0) {
+        return 0;
+    }
+
+    // Binary search the glyph's run for the second codepoint.
+    const BmFont::KerningEntry* entries = font->lookup.kerning_entries;
+    int low = font->lookup.kerning_runs[glyph];
+    int high = font->lookup.kerning_runs[glyph + 1];
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (entries[middle].second < second) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < font->lookup.kerning_runs[glyph + 1] &&
+            entries[low].second == second) {
+        return entries[low].amount;
     }
     return 0;
 }
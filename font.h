@@ -1,5 +1,7 @@
 #pragma once
 
+#include "file_mapping.h"
+
 // Bitmap Font Generator .fnt file
 struct BmFont {
     struct Image {
@@ -18,19 +20,42 @@ struct BmFont {
         int amount;
     };
 
+    struct KerningEntry {
+        char32_t second;
+        int amount;
+    };
+
+    // Built after loading, or stored in a compiled font, for the lookups done
+    // for every character drawn.
+    struct Lookup {
+        int latin1[256]; // glyph indices, or -1 where there's no glyph
+        int* displacements; // for each bucket of the perfect hash
+        int* slots; // glyph indices
+        int slot_count;
+        int* kerning_runs; // where each glyph's run starts, plus the end
+        KerningEntry* kerning_entries; // by first glyph, then by second
+    };
+
     Image image;
     Glyph* glyphs;
-    KerningPair* kerning_table;
+    KerningPair* kerning_table; // null if loaded compiled
     char32_t* character_map;
     int num_glyphs;
     int num_kerning_pairs;
     int size;
     int baseline, tracking, leading;
     int scale_horizontal, scale_vertical;
+    FileMapping mapping; // the tables live in here, if loaded compiled
+    Lookup lookup;
 };
 
 bool bm_font_load(BmFont* font, const char* filename);
 void bm_font_unload(BmFont* font);
 
+// A compiled font is a binary file holding the tables ready to use, which
+// loads by mapping the file in rather than parsing anything.
+bool bm_font_compile(BmFont* font, const char* filename);
+bool bm_font_load_compiled(BmFont* font, const char* filename);
+
 BmFont::Glyph* bm_font_get_character_mapping(BmFont* font, char32_t c);
 int bm_font_get_kerning(BmFont* font, char32_t first, char32_t second);
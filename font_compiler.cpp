@@ -0,0 +1,30 @@
+// Compiles a Bitmap Font Generator .fnt file into the binary form which
+// bm_font_load_compiled maps straight in.
+//
+//     font_compiler input.fnt output.cfnt
+
+#include "font.h"
+#include "logging.h"
+
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        LOG_ERROR("Usage: %s input.fnt output.cfnt", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    BmFont font;
+    if (!bm_font_load(&font, argv[1])) {
+        LOG_ERROR("Couldn't load the font %s.", argv[1]);
+        return EXIT_FAILURE;
+    }
+    bool compiled = bm_font_compile(&font, argv[2]);
+    bm_font_unload(&font);
+    if (!compiled) {
+        LOG_ERROR("Couldn't write the compiled font %s.", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
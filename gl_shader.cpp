@@ -114,44 +114,65 @@ static char* load_text_file(const char* filename, long* size) {
     return buffer;
 }
 
-static GLuint load_shader_from_file(GLenum type, const char* filename) {
-    GLuint shader;
-
-    // Load the shader source code from a file.
-
-    long char_count = 0;
-    GLchar* shader_source = load_text_file(filename, &char_count);
-    if (!shader_source) {
-        LOG_ERROR("Couldn't load the shader source file.");
-        return 0;
+// Reads the source of one shader, or points at the default source if there's
+// no file.
+static bool load_shader_source(const char* filename, const char* default_source,
+                               char** source, long* size) {
+    if (!filename) {
+        *source = const_cast<char*>(default_source);
+        *size = string_size(default_source);
+        return true;
+    }
+    *source = load_text_file(filename, size);
+    if (!*source) {
+        LOG_ERROR("Couldn't load the shader source file %s.", filename);
+        return false;
     }
-    GLint shader_source_size = char_count;
+    return true;
+}
 
-    shader = load_shader_from_source(type, shader_source, shader_source_size);
-    HEAP_DEALLOCATE(shader_source);
+bool load_shader_sources(ShaderSources* sources, const char* vertex_file,
+                         const char* fragment_file) {
+    sources->vertex_file = vertex_file;
+    sources->fragment_file = fragment_file;
+    sources->fragment_source = nullptr;
+    bool loaded = load_shader_source(vertex_file, default_vertex_source,
+                                     &sources->vertex_source,
+                                     &sources->vertex_size);
+    if (loaded) {
+        loaded = load_shader_source(fragment_file, default_fragment_source,
+                                    &sources->fragment_source,
+                                    &sources->fragment_size);
+    }
+    return loaded;
+}
 
-    return shader;
+void unload_shader_sources(ShaderSources* sources) {
+    if (sources->vertex_file) {
+        HEAP_DEALLOCATE(sources->vertex_source);
+    }
+    if (sources->fragment_file) {
+        HEAP_DEALLOCATE(sources->fragment_source);
+    }
 }
 
-GLuint load_shader_program(const char* vertex_file, const char* fragment_file) {
+GLuint build_shader_program(ShaderSources* sources) {
     GLuint program;
+    const char* vertex_file = sources->vertex_file;
+    const char* fragment_file = sources->fragment_file;
 
-    GLuint vertex_shader;
-    if (vertex_file) {
-        vertex_shader = load_shader_from_file(GL_VERTEX_SHADER, vertex_file);
-    } else {
-        vertex_shader = load_shader_from_source(GL_VERTEX_SHADER, default_vertex_source, string_size(default_vertex_source));
+    GLuint vertex_shader = 0;
+    if (sources->vertex_source) {
+        vertex_shader = load_shader_from_source(GL_VERTEX_SHADER, sources->vertex_source, sources->vertex_size);
     }
     if (vertex_shader == 0) {
         LOG_ERROR("Failed to load the vertex shader %s.", vertex_file);
         return 0;
     }
 
-    GLuint fragment_shader;
-    if (fragment_file) {
-        fragment_shader = load_shader_from_file(GL_FRAGMENT_SHADER, fragment_file);
-    } else {
-        fragment_shader = load_shader_from_source(GL_FRAGMENT_SHADER, default_fragment_source, string_size(default_fragment_source));
+    GLuint fragment_shader = 0;
+    if (sources->fragment_source) {
+        fragment_shader = load_shader_from_source(GL_FRAGMENT_SHADER, sources->fragment_source, sources->fragment_size);
     }
     if (fragment_shader == 0) {
         LOG_ERROR("Failed to load the fragment shader %s.", fragment_file);
@@ -196,3 +217,13 @@ GLuint load_shader_program(const char* vertex_file, const char* fragment_file) {
 
     return program;
 }
+
+GLuint load_shader_program(const char* vertex_file, const char* fragment_file) {
+    ShaderSources sources;
+    GLuint program = 0;
+    if (load_shader_sources(&sources, vertex_file, fragment_file)) {
+        program = build_shader_program(&sources);
+    }
+    unload_shader_sources(&sources);
+    return program;
+}
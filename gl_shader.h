@@ -3,3 +3,20 @@
 #include "gl_core_3_3.h"
 
 GLuint load_shader_program(const char* vertex_file, const char* fragment_file);
+
+// The source of each shader in a program, read in ahead of building it.
+// Reading them doesn't touch OpenGL, so it can be done on any thread, but
+// building the program has to be done on the thread with the context.
+struct ShaderSources {
+    const char* vertex_file; // or null to use the default shader
+    const char* fragment_file; // or null to use the default shader
+    char* vertex_source;
+    char* fragment_source;
+    long vertex_size;
+    long fragment_size;
+};
+
+bool load_shader_sources(ShaderSources* sources, const char* vertex_file,
+                         const char* fragment_file);
+void unload_shader_sources(ShaderSources* sources);
+GLuint build_shader_program(ShaderSources* sources);
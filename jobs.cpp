@@ -0,0 +1,213 @@
+#include "jobs.h"
+
+#include "logging.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#define MAX_JOBS 64
+#define MAX_WORKERS 8
+
+namespace jobs {
+
+// An id is the slot a job's in, along with how many jobs have used the slot,
+// so an id still says whether its job is done after the slot's reused.
+#define JOB_INDEX_BITS 8
+#define JOB_INDEX_MASK ((1u << JOB_INDEX_BITS) - 1)
+
+enum class JobState {
+    Free,
+    Queued,
+    Running,
+    Done,
+};
+
+struct Job {
+    Function function;
+    void* data;
+    unsigned int generation;
+    JobState state;
+};
+
+namespace {
+    Job job_slots[MAX_JOBS];
+    int queue[MAX_JOBS]; // slot indices, in the order they were submitted
+    int queue_start;
+    int queue_count;
+    pthread_t workers[MAX_WORKERS];
+    int worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_queued;
+    pthread_cond_t job_done;
+    bool quit;
+}
+
+static JobId make_id(int index, unsigned int generation) {
+    return generation << JOB_INDEX_BITS | index;
+}
+
+static void* run_worker(void* argument) {
+    static_cast<void>(argument);
+
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        while (queue_count == 0 && !quit) {
+            pthread_cond_wait(&job_queued, &mutex);
+        }
+        if (queue_count == 0) {
+            break;
+        }
+
+        int index = queue[queue_start];
+        queue_start = (queue_start + 1) % MAX_JOBS;
+        queue_count -= 1;
+
+        Job* job = &job_slots[index];
+        job->state = JobState::Running;
+        pthread_mutex_unlock(&mutex);
+
+        job->function(job->data);
+
+        pthread_mutex_lock(&mutex);
+        job->state = JobState::Done;
+        pthread_cond_broadcast(&job_done);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return nullptr;
+}
+
+bool startup(int requested_workers) {
+    std::memset(job_slots, 0, sizeof job_slots);
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        job_slots[i].generation = 1;
+    }
+    queue_start = 0;
+    queue_count = 0;
+    quit = false;
+
+    if (requested_workers <= 0) {
+        requested_workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (requested_workers < 1) {
+            requested_workers = 1;
+        }
+    }
+    if (requested_workers > MAX_WORKERS) {
+        requested_workers = MAX_WORKERS;
+    }
+
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&job_queued, nullptr);
+    pthread_cond_init(&job_done, nullptr);
+
+    worker_count = 0;
+    for (int i = 0; i < requested_workers; ++i) {
+        int result = pthread_create(&workers[i], nullptr, run_worker, nullptr);
+        if (result != 0) {
+            LOG_ERROR("Couldn't create a job worker thread: %s",
+                      std::strerror(result));
+            break;
+        }
+        worker_count += 1;
+    }
+
+    return worker_count > 0;
+}
+
+void shutdown() {
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    pthread_cond_broadcast(&job_queued);
+    pthread_mutex_unlock(&mutex);
+
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i], nullptr);
+    }
+    worker_count = 0;
+
+    pthread_cond_destroy(&job_done);
+    pthread_cond_destroy(&job_queued);
+    pthread_mutex_destroy(&mutex);
+}
+
+JobId submit(Function function, void* data) {
+    pthread_mutex_lock(&mutex);
+
+    Job* job = nullptr;
+    int index;
+    if (worker_count > 0) {
+        for (index = 0; index < MAX_JOBS; ++index) {
+            if (job_slots[index].state == JobState::Free) {
+                job = &job_slots[index];
+                break;
+            }
+        }
+    }
+    if (!job) {
+        pthread_mutex_unlock(&mutex);
+        function(data);
+        return 0;
+    }
+
+    job->function = function;
+    job->data = data;
+    job->state = JobState::Queued;
+    queue[(queue_start + queue_count) % MAX_JOBS] = index;
+    queue_count += 1;
+    JobId id = make_id(index, job->generation);
+
+    pthread_cond_signal(&job_queued);
+    pthread_mutex_unlock(&mutex);
+
+    return id;
+}
+
+// Frees the job's slot for another, which makes every id for it say it's
+// done. This has to be called with the mutex locked.
+static void retire(Job* job) {
+    job->state = JobState::Free;
+    job->generation = (job->generation + 1) & (~0u >> JOB_INDEX_BITS);
+    if (job->generation == 0) {
+        job->generation = 1;
+    }
+}
+
+bool is_done(JobId id) {
+    if (id == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&mutex);
+    Job* job = &job_slots[id & JOB_INDEX_MASK];
+    bool done = true;
+    if (job->generation == id >> JOB_INDEX_BITS) {
+        done = job->state == JobState::Done;
+        if (done) {
+            retire(job);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return done;
+}
+
+void wait(JobId id) {
+    if (id == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    Job* job = &job_slots[id & JOB_INDEX_MASK];
+    unsigned int generation = id >> JOB_INDEX_BITS;
+    while (job->generation == generation && job->state != JobState::Done) {
+        pthread_cond_wait(&job_done, &mutex);
+    }
+    if (job->generation == generation) {
+        retire(job);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+} // namespace jobs
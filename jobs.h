@@ -0,0 +1,28 @@
+#pragma once
+
+// Jobs run on a pool of worker threads, for work like reading and decoding
+// assets that doesn't have to happen on the main thread. Anything which does,
+// like creating OpenGL objects, is left for the main thread to finish once
+// the job's done.
+namespace jobs {
+
+// Zero is never the id of a job still to be done, so it can stand for one
+// that's finished.
+typedef unsigned int JobId;
+
+typedef void (*Function)(void* data);
+
+// A worker count of zero picks one fewer than the number of processors.
+bool startup(int worker_count = 0);
+// Any jobs still to be done are run before this returns.
+void shutdown();
+
+// If no worker can take the job, it's run on the calling thread instead.
+JobId submit(Function function, void* data);
+
+// Once either says a job is done, the id is finished with, and asking about
+// it again only says it's done.
+bool is_done(JobId id);
+void wait(JobId id);
+
+} // namespace jobs
@@ -17,3 +17,4 @@ namespace logging {
 #endif
 
 #define	LOG_ERROR(format, ...) logging::add_message(logging::Level::Error, (format), ##__VA_ARGS__)
+#define	LOG_INFO(format, ...) logging::add_message(logging::Level::Info, (format), ##__VA_ARGS__)
@@ -7,6 +7,11 @@
 #include "string_utilities.h"
 #include "unicode.h"
 #include "random.h"
+#include "text_layout.h"
+#include "jobs.h"
+#include "asset_pack.h"
+#include "file_watcher.h"
+#include "pixel_cache.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -45,23 +50,116 @@
 #define DEALLOCATE(a) \
     std::free(a)
 
+// Decodes an image straight out of the asset pack, if it's in there.
+static u8* load_pixels(const char* path, int* width, int* height,
+                       int* bytes_per_pixel) {
+    FileMapping packed;
+    if (find_packed_file(&packed, path)) {
+        return stbi_load_from_memory(static_cast<const stbi_uc*>(packed.data),
+                                     packed.size, width, height,
+                                     bytes_per_pixel, 0);
+    }
+    return stbi_load(path, width, height, bytes_per_pixel, 0);
+}
+
 struct Atlas {
     u8* data;
     int width;
     int height;
     int bytes_per_pixel;
+    CachedPixels cached; // holds the data, if it came from the pixel cache
 };
 
+// Images with four channels are already the 32-bit pixels that get drawn, so
+// they're put in the pixel cache once decoded, and the next time the same
+// image is loaded it's mapped in from there instead.
 static void load_atlas(Atlas* atlas, const char* name) {
     char path[256];
     copy_string(path, "Assets/", sizeof path);
     append_string(path, name, sizeof path);
-    atlas->data = stbi_load(path, &atlas->width, &atlas->height,
-                            &atlas->bytes_per_pixel, 0);
+
+    atlas->data = nullptr;
+    atlas->cached.mapping.data = nullptr;
+    atlas->cached.mapping.size = 0;
+    atlas->cached.mapping.owned = false;
+
+    FileMapping source;
+    if (!find_packed_file(&source, path) && !map_file(&source, path)) {
+        return;
+    }
+
+    u64 key = hash_pixel_source(source.data, source.size);
+    if (load_cached_pixels(&atlas->cached, path, key)) {
+        // The mapping is read-only, and atlases are only ever read from.
+        atlas->data = reinterpret_cast<u8*>(const_cast<u32*>(atlas->cached.pixels));
+        atlas->width = atlas->cached.width;
+        atlas->height = atlas->cached.height;
+        atlas->bytes_per_pixel = 4;
+    } else {
+        atlas->data = stbi_load_from_memory(
+            static_cast<const stbi_uc*>(source.data), source.size,
+            &atlas->width, &atlas->height, &atlas->bytes_per_pixel, 0);
+        if (atlas->data && atlas->bytes_per_pixel == 4) {
+            save_cached_pixels(path, key,
+                               reinterpret_cast<u32*>(atlas->data),
+                               atlas->width, atlas->height);
+        }
+    }
+    unmap_file(&source);
 }
 
 static void unload_atlas(Atlas* atlas) {
-    stbi_image_free(atlas->data);
+    if (atlas->cached.mapping.data) {
+        unload_cached_pixels(&atlas->cached);
+    } else {
+        stbi_image_free(atlas->data);
+    }
+}
+
+// A single channel of how much of each texel is covered, which is all a font
+// page needs once glyphs can be drawn in any colour. It's a quarter the size
+// of the page it's made from.
+struct CoverageMask {
+    u8* data;
+    int width;
+    int height;
+};
+
+static void load_coverage_mask(CoverageMask* mask, const char* name) {
+    Atlas atlas;
+    load_atlas(&atlas, name);
+    mask->data = nullptr;
+    mask->width = 0;
+    mask->height = 0;
+    if (!atlas.data) {
+        return;
+    }
+    mask->width = atlas.width;
+    mask->height = atlas.height;
+
+    // Take the coverage from the alpha channel, or for pages without one,
+    // from how bright the texel is. The brightness of a colour page weighs
+    // each channel by how bright it looks, as in Rec. 601.
+    int texel_count = atlas.width * atlas.height;
+    mask->data = ALLOCATE_ARRAY(u8, texel_count);
+    int channels = atlas.bytes_per_pixel;
+    if (channels == 3) {
+        for (int i = 0; i < texel_count; ++i) {
+            const u8* texel = atlas.data + 3 * i;
+            mask->data[i] = (77 * texel[0] + 150 * texel[1] + 29 * texel[2]) >> 8;
+        }
+    } else {
+        int coverage_channel = (channels == 2 || channels == 4) ? channels - 1 : 0;
+        for (int i = 0; i < texel_count; ++i) {
+            mask->data[i] = atlas.data[channels * i + coverage_channel];
+        }
+    }
+
+    unload_atlas(&atlas);
+}
+
+static void unload_coverage_mask(CoverageMask* mask) {
+    DEALLOCATE(mask->data);
 }
 
 struct Image {
@@ -72,8 +170,8 @@ struct Image {
 };
 
 static void load_image(Image* image, const char* name) {
-    image->data = stbi_load(name, &image->width, &image->height,
-                            &image->bytes_per_pixel, 0);
+    image->data = load_pixels(name, &image->width, &image->height,
+                              &image->bytes_per_pixel);
 }
 
 static void unload_image(Image* image) {
@@ -417,100 +515,183 @@ static const u32 distinct_colour_table[64] = {
 
 // Text-rendering functions....................................................
 
-/*
-Distinguishes characters which have no visible mark or glyph. This is as
-opposed to "whitespace" characters, which includes the ogham space mark
-conditionally displayed as a glyph depending on context.
-*/
-static bool is_character_non_displayable(char32_t codepoint) {
-    switch (codepoint) {
-        case 0x9: // character tabulation
-        case 0xA: // line feed
-        case 0xB: // line tabulation
-        case 0xC: // form feed
-        case 0xD: // carriage return
-        case 0x20: // space
-        case 0x85: // next line
-        case 0xA0: // no-break space
-        case 0x2000: // en quad
-        case 0x2001: // em quad
-        case 0x2002: // en space
-        case 0x2003: // em space
-        case 0x2004: // three-per-em space
-        case 0x2005: // four-per-em space
-        case 0x2006: // six-per-em space
-        case 0x2007: // figure space
-        case 0x2008: // punctuation space
-        case 0x2009: // thin space
-        case 0x200A: // hair space
-        case 0x2028: // line separator
-        case 0x2029: // paragraph separator
-        case 0x202F: // narrow no-break space
-        case 0x205F: // medium mathematical space
-        case 0x3000: // ideographic space
-            return true;
-    }
-    return false;
+// Draws a run of glyphs all in one colour, a row of a glyph at a time. Each
+// texel of the mask blends the colour over the canvas by how covered it is.
+static void draw_glyph_run(Canvas* canvas, CoverageMask* mask,
+                           const TextLayout::Quad* quads, int quad_count,
+                           int cx, int cy, u32 colour) {
+    u32 fr = GET_RED(colour);
+    u32 fg = GET_GREEN(colour);
+    u32 fb = GET_BLUE(colour);
+
+    for (int i = 0; i < quad_count; ++i) {
+        const TextLayout::Quad* quad = &quads[i];
+
+        // Clip the quad to the canvas. Glyphs are never meant to reach
+        // outside the mask, so skip any that would rather than wrap around.
+        int left = cx + quad->x;
+        int top = cy + quad->y;
+        int tx = quad->texcoord.left;
+        int ty = quad->texcoord.top;
+        int width = quad->texcoord.width;
+        int height = quad->texcoord.height;
+        if (left < 0) {
+            tx -= left;
+            width += left;
+            left = 0;
+        }
+        if (top < 0) {
+            ty -= top;
+            height += top;
+            top = 0;
+        }
+        int extra_width = (left + width) - canvas->width;
+        if (extra_width > 0) {
+            width -= extra_width;
+        }
+        int extra_height = (top + height) - canvas->height;
+        if (extra_height > 0) {
+            height -= extra_height;
+        }
+        if (tx < 0 || ty < 0 || tx + width > mask->width ||
+                ty + height > mask->height) {
+            continue;
+        }
+
+        for (int y = 0; y < height; ++y) {
+            const u8* coverage = &mask->data[(ty + y) * mask->width + tx];
+            u32* row = &canvas->pixels[(top + y) * canvas->width + left];
+            for (int x = 0; x < width; ++x) {
+                u32 covered = coverage[x];
+                if (covered == 0xFF) {
+                    row[x] = colour;
+                } else if (covered) {
+                    u32 a = covered + 1;
+                    u32 ia = 256 - covered;
+                    u32 background = row[x];
+                    row[x] = PACK_RGB((a * fr + ia * GET_RED(background)) >> 8,
+                                      (a * fg + ia * GET_GREEN(background)) >> 8,
+                                      (a * fb + ia * GET_BLUE(background)) >> 8);
+                }
+            }
+        }
+    }
 }
 
-// @Incomplete: This doesn't fully handle Unicode line breaks. If this turns
-// out to be insufficient, check the Lattice project for how to do more
-// complete line-break handling.
-static bool is_line_break(char32_t codepoint) {
-    switch (codepoint) {
-        case 0xA: // line feed
-        case 0xC: // form feed
-        case 0xD: // carriage return
-        case 0x85: // next line
-        case 0x2028: // line separator
-        case 0x2029: // paragraph separator
-            return true;
-    }
-    return false;
+static void draw_text(Canvas* canvas, CoverageMask* mask,
+                      TextLayoutCache* layout_cache, BmFont* font,
+                      const char* text, int cx, int cy, u32 colour) {
+    TextLayout layout = get_text_layout(layout_cache, font, text, 0);
+    draw_glyph_run(canvas, mask, layout.quads, layout.quad_count, cx, cy,
+                   colour);
 }
 
-#define STACK_ALLOCATE_ARRAY(count, type) \
-    static_cast<type*>(alloca(sizeof(type) * (count)))
+static void draw_text_box(Canvas* canvas, CoverageMask* mask, TextBox* box,
+                          int cx, int cy, u32 colour) {
+    int y = cy;
+    for (int i = 0; i < box->paragraph_count; ++i) {
+        TextParagraph* paragraph = &box->paragraphs[i];
+        draw_glyph_run(canvas, mask, paragraph->quads, paragraph->quad_count,
+                       cx, y, colour);
+        y += paragraph->line_count * box->font->leading;
+    }
+}
 
-static void draw_text(Canvas* canvas, Atlas* atlas, BmFont* font,
-                      const char* text, int cx, int cy) {
+// Asset Loading Jobs..........................................................
 
-    int char_count = string_size(text);
-    int codepoint_count = utf8_codepoint_count(text);
-    char32_t* codepoints = STACK_ALLOCATE_ARRAY(codepoint_count, char32_t);
-    utf8_to_utf32(text, char_count, codepoints, codepoint_count);
+struct AtlasJob {
+    Atlas* atlas;
+    const char* name;
+};
 
-    struct { int x, y; } pen;
-    pen.x = cx;
-    pen.y = cy;
+static void run_atlas_job(void* data) {
+    AtlasJob* job = static_cast<AtlasJob*>(data);
+    load_atlas(job->atlas, job->name);
+}
 
-    char32_t prior_char = 0x0;
-    for (int i = 0; i < char_count; ++i) {
-        char32_t c = text[i];
-        BmFont::Glyph* glyph = bm_font_get_character_mapping(font, c);
+struct FontJob {
+    BmFont* font;
+    CoverageMask* mask;
+    const char* compiled_filename;
+    const char* filename;
+};
 
-        if (is_line_break(c)) {
-            pen.x = cx;
-            pen.y += font->leading;
-        } else {
-            pen.x += bm_font_get_kerning(font, prior_char, c);
-
-            if (is_character_non_displayable(c)) {
-                pen.x += glyph->x_advance;
-            } else {
-                int x = pen.x + glyph->x_offset;
-                int y = pen.y + glyph->y_offset;
-                int tx = glyph->texcoord.left;
-                int ty = glyph->texcoord.top;
-                int tw = glyph->texcoord.width;
-                int th = glyph->texcoord.height;
-                draw_subimage(canvas, atlas, x, y, tx, ty, tw, th);
-                pen.x += font->tracking + glyph->x_advance;
-            }
-        }
+static void run_font_job(void* data) {
+    FontJob* job = static_cast<FontJob*>(data);
+
+    // The compiled font loads in place, so use it if it's been built.
+    if (!bm_font_load_compiled(job->font, job->compiled_filename)) {
+        bm_font_load(job->font, job->filename);
+    }
+    load_coverage_mask(job->mask, job->font->image.filename);
+}
+
+struct ShaderSourcesJob {
+    ShaderSources* sources;
+    const char* vertex_file;
+    const char* fragment_file;
+};
+
+static void run_shader_sources_job(void* data) {
+    ShaderSourcesJob* job = static_cast<ShaderSourcesJob*>(data);
+    load_shader_sources(job->sources, job->vertex_file, job->fragment_file);
+}
 
-        prior_char = c;
+// Hot Reloading...............................................................
+//     While developing, assets are loaded again whenever their files change.
+//     It's done between frames, so nothing's part way through using them, and
+//     if the new version doesn't load, the old one is kept.
+
+static void bind_texture_units(GLuint program) {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "texture"), 0);
+    glUniform1i(glGetUniformLocation(program, "dot_crawl_texture"), 1);
+}
+
+static void reload_shader(GLuint* program, const char* fragment_file) {
+    GLuint reloaded = load_shader_program(nullptr, fragment_file);
+    if (reloaded == 0) {
+        LOG_ERROR("Kept the old version of %s, since the new one didn't build.",
+                  fragment_file);
+        return;
+    }
+    glDeleteProgram(*program);
+    *program = reloaded;
+    bind_texture_units(reloaded);
+    LOG_INFO("Reloaded %s.", fragment_file);
+}
+
+static void reload_atlas(Atlas* atlas, const char* name) {
+    Atlas reloaded;
+    load_atlas(&reloaded, name);
+    if (!reloaded.data) {
+        LOG_ERROR("Kept the old version of %s, since the new one didn't load.",
+                  name);
+        return;
+    }
+    unload_atlas(atlas);
+    *atlas = reloaded;
+    LOG_INFO("Reloaded %s.", name);
+}
+
+static void reload_coverage_mask(CoverageMask* mask, const char* name) {
+    CoverageMask reloaded;
+    load_coverage_mask(&reloaded, name);
+    if (!reloaded.data) {
+        LOG_ERROR("Kept the old version of %s, since the new one didn't load.",
+                  name);
+        return;
     }
+    unload_coverage_mask(mask);
+    *mask = reloaded;
+    LOG_INFO("Reloaded %s.", name);
+}
+
+static int watch_asset(FileWatcher* watcher, const char* name) {
+    char path[256];
+    copy_string(path, "Assets/", sizeof path);
+    append_string(path, name, sizeof path);
+    return watch_file(watcher, path);
 }
 
 // Clock Functions.............................................................
@@ -563,7 +744,7 @@ static bool load_pixmap(Pixmap* out_pixmap, Display* display,
     int width;
     int height;
     int bytes_per_pixel;
-    u8* pixel_data = stbi_load(name, &width, &height, &bytes_per_pixel, 0);
+    u8* pixel_data = load_pixels(name, &width, &height, &bytes_per_pixel);
     if (!pixel_data) {
         return false;
     }
@@ -643,6 +824,30 @@ static void set_icons(Display* display, Window window, Atom net_wm_icon,
     std::free(icon_buffer);
 }
 
+// Renders the script twice over, to check the mixer comes out the same every
+// time, and reports how quickly it went.
+static bool render_audio(const char* script, const char* output) {
+    audio::RenderReport first;
+    audio::RenderReport second;
+    if (!audio::render(script, output, &first) ||
+            !audio::render(script, output, &second)) {
+        return false;
+    }
+
+    double taken = first.seconds_taken + second.seconds_taken;
+    double rendered = first.seconds_rendered + second.seconds_rendered;
+    LOG_INFO("Rendered %f seconds of audio to %s at %f seconds per second.",
+             first.seconds_rendered, output, rendered / taken);
+    if (first.checksum != second.checksum) {
+        LOG_ERROR("The two renders differ: %016llx then %016llx.",
+                  first.checksum, second.checksum);
+        return false;
+    }
+    LOG_INFO("Both renders were identical, with checksum %016llx.",
+             first.checksum);
+    return true;
+}
+
 static int error_handler(Display* display, XErrorEvent* event) {
     char text[128];
     XGetErrorText(display, event->error_code, text, sizeof text);
@@ -742,18 +947,101 @@ int main(int argc, char** argv) {
     Canvas canvas;
     Atlas atlas;
     BmFont test_font;
-    Atlas test_font_atlas;
+    CoverageMask test_font_mask;
+    TextLayoutCache text_layout_cache;
+    TextBox dialogue_box;
+    const char* dialogue;
+    int dialogue_typed; // how many bytes have gone into the box
     audio::StreamId test_music;
+    audio::Settings audio_settings;
+
+    // Handle any command-line options.
+    audio_settings.backend = audio::Backend::Alsa;
+    audio_settings.output_filename = nullptr;
+    audio_settings.scheduling = audio::Scheduling::Normal;
+    audio_settings.lock_memory = false;
+    audio_settings.cpu = -1;
+    audio_settings.adaptive_period = false;
+    const char* render_script = nullptr;
+    const char* render_output = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strings_match(argv[i], "--null-audio")) {
+            audio_settings.backend = audio::Backend::Null;
+        } else if (strings_match(argv[i], "--unthrottled-audio")) {
+            audio_settings.backend = audio::Backend::Null_Unthrottled;
+        } else if (strings_match(argv[i], "--audio-file") && i + 1 < argc) {
+            audio_settings.backend = audio::Backend::Wave_File;
+            audio_settings.output_filename = argv[++i];
+        } else if (strings_match(argv[i], "--realtime-audio")) {
+            audio_settings.scheduling = audio::Scheduling::Fifo;
+            audio_settings.lock_memory = true;
+        } else if (strings_match(argv[i], "--audio-cpu") && i + 1 < argc) {
+            audio_settings.cpu = std::atoi(argv[++i]);
+        } else if (strings_match(argv[i], "--adaptive-audio")) {
+            audio_settings.adaptive_period = true;
+        } else if (strings_match(argv[i], "--render-audio") && i + 2 < argc) {
+            render_script = argv[++i];
+            render_output = argv[++i];
+        } else {
+            LOG_ERROR("Unrecognised option %s", argv[i]);
+        }
+    }
+
+    // Assets are loaded out of the pack, if one's been built, rather than
+    // from each file under Assets/ on its own. Anything not in the pack is
+    // still loaded from its file.
+    bool pack_opened = open_asset_pack("Assets.pack");
+    if (pack_opened) {
+        LOG_DEBUG("Loading assets from Assets.pack.");
+    }
+
+    // Rendering audio offline is all that's done, when it's asked for.
+    if (render_script) {
+        monitoring::startup();
+        bool rendered = render_audio(render_script, render_output);
+        monitoring::shutdown();
+        close_asset_pack();
+        if (!rendered) {
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
 
     XSetErrorHandler(error_handler);
 
-    // Connect to the X server
+    // Connect to the X server. This is done before any jobs are started,
+    // since they write into locals here and can't be left running if it
+    // fails.
     display = XOpenDisplay(nullptr);
     if (!display) {
         LOG_ERROR("Cannot connect to X server");
+        close_asset_pack();
         return EXIT_FAILURE;
     }
 
+    // Start reading and decoding assets in the background, while the window
+    // and OpenGL are set up. Whatever has to be done with the context is
+    // finished on this thread once each job's done.
+    jobs::startup();
+
+    ShaderSources shader_sources[4];
+    ShaderSourcesJob shader_jobs[4] = {
+        {&shader_sources[0], nullptr, nullptr},
+        {&shader_sources[1], nullptr, "Assets/Shaders/yiq.fs"},
+        {&shader_sources[2], nullptr, "Assets/Shaders/composite.fs"},
+        {&shader_sources[3], nullptr, "Assets/Shaders/fringing.fs"},
+    };
+    jobs::JobId shader_job_ids[4];
+    FOR_N(i, 4) {
+        shader_job_ids[i] = jobs::submit(run_shader_sources_job, &shader_jobs[i]);
+    }
+
+    AtlasJob atlas_job = {&atlas, "player.png"};
+    jobs::JobId atlas_job_id = jobs::submit(run_atlas_job, &atlas_job);
+
+    FontJob font_job = {&test_font, &test_font_mask, "Assets/droid_12.cfnt", "Assets/droid_12.fnt"};
+    jobs::JobId font_job_id = jobs::submit(run_font_job, &font_job);
+
     // The dimensions of the final canvas after up-scaling.
 
     int scaled_width = pixel_scale * canvas_width;
@@ -931,23 +1219,16 @@ int main(int argc, char** argv) {
 
     // shader uniform setup for samplers
     {
-        canvas_shader = load_shader_program(nullptr, nullptr);
-        pass1_shader = load_shader_program(nullptr, "Assets/Shaders/yiq.fs");
-        pass2_shader = load_shader_program(nullptr, "Assets/Shaders/composite.fs");
-        pass3_shader = load_shader_program(nullptr, "Assets/Shaders/fringing.fs");
-
-        glUseProgram(canvas_shader);
-        glUniform1i(glGetUniformLocation(canvas_shader, "texture"), 0);
-
-        glUseProgram(pass1_shader);
-        glUniform1i(glGetUniformLocation(pass1_shader, "texture"), 0);
-
-        glUseProgram(pass2_shader);
-        glUniform1i(glGetUniformLocation(pass2_shader, "texture"), 0);
-        glUniform1i(glGetUniformLocation(pass2_shader, "dot_crawl_texture"), 1);
+        GLuint* programs[4] = {&canvas_shader, &pass1_shader, &pass2_shader, &pass3_shader};
+        FOR_N(i, 4) {
+            jobs::wait(shader_job_ids[i]);
+            *programs[i] = build_shader_program(&shader_sources[i]);
+            unload_shader_sources(&shader_sources[i]);
+        }
 
-        glUseProgram(pass3_shader);
-        glUniform1i(glGetUniformLocation(pass3_shader, "texture"), 0);
+        FOR_N(i, 4) {
+            bind_texture_units(*programs[i]);
+        }
     }
 
     {
@@ -989,16 +1270,37 @@ int main(int argc, char** argv) {
     // Initialise any other resources needed before the main loop starts.
     monitoring::startup();
     input::startup();
-    audio::startup();
+    audio::startup(&audio_settings);
 
     initialise_clock(&clock);
 
-    // Load the test assets.
-    load_atlas(&atlas, "player.png");
+    // Finish loading the test assets.
     audio::start_stream("grass.ogg", 0.0f, &test_music);
-
-    bm_font_load(&test_font, "Assets/droid_12.fnt");
-    load_atlas(&test_font_atlas, test_font.image.filename);
+    jobs::wait(atlas_job_id);
+    jobs::wait(font_job_id);
+    create_text_layout_cache(&text_layout_cache);
+    create_text_box(&dialogue_box, &test_font, 200, TextAlignment::Left);
+    dialogue = "There is no need to hurry. The containers will keep, and the tea is still warm.";
+    dialogue_typed = 0;
+
+    // Watch the assets which can be loaded again while the game's running.
+    // Nothing's watched when assets come from the pack, since that's not
+    // what gets edited.
+    FileWatcher watcher;
+    bool watching = !pack_opened && create_file_watcher(&watcher);
+    GLuint* reloadable_shaders[3] = {&pass1_shader, &pass2_shader, &pass3_shader};
+    int shader_files[3] = {-1, -1, -1};
+    int atlas_file = -1;
+    int font_page_file = -1;
+    if (watching) {
+        FOR_N(i, 3) {
+            shader_files[i] = watch_file(&watcher, shader_jobs[i + 1].fragment_file);
+        }
+        atlas_file = watch_asset(&watcher, atlas_job.name);
+        if (test_font_mask.data) {
+            font_page_file = watch_asset(&watcher, test_font.image.filename);
+        }
+    }
 
     // Enable Vertical Synchronisation.
     if (!have_ext_swap_control) {
@@ -1024,6 +1326,20 @@ int main(int argc, char** argv) {
         // Record when the frame starts.
         double frame_start_time = get_time(&clock);
 
+        if (watching && check_watched_files(&watcher)) {
+            FOR_N(i, 3) {
+                if (file_changed(&watcher, shader_files[i])) {
+                    reload_shader(reloadable_shaders[i], shader_jobs[i + 1].fragment_file);
+                }
+            }
+            if (file_changed(&watcher, atlas_file)) {
+                reload_atlas(&atlas, atlas_job.name);
+            }
+            if (file_changed(&watcher, font_page_file)) {
+                reload_coverage_mask(&test_font_mask, test_font.image.filename);
+            }
+        }
+
         BEGIN_MONITORING(rendering);
 
         // Push the last frame as soon as possible.
@@ -1135,10 +1451,28 @@ int main(int argc, char** argv) {
         }
 
         {
-            draw_text(&canvas, &test_font_atlas, &test_font, "well, obviously we will leave", 10, 100);
-            draw_text(&canvas, &test_font_atlas, &test_font, "our earthly containers", 10, 110);
+            draw_text(&canvas, &test_font_mask, &text_layout_cache, &test_font, "well, obviously we will leave", 10, 100, 0xFFFFFF);
+            draw_text(&canvas, &test_font_mask, &text_layout_cache, &test_font, "our earthly containers", 10, 110, 0xFFFFFF);
+            age_text_layouts(&text_layout_cache);
+
+            // Type the dialogue out a character at a time.
+            if (dialogue[dialogue_typed]) {
+                const char* rest = dialogue + dialogue_typed;
+                char next[5] = {};
+                int size = 0;
+                do {
+                    next[size] = rest[size];
+                    size += 1;
+                } while (size < 4 && (rest[size] & 0xC0) == 0x80);
+                append_text_box_text(&dialogue_box, next);
+                dialogue_typed += size;
+            }
+            draw_text_box(&canvas, &test_font_mask, &dialogue_box, 10, 130, 0x010067);
         }
 
+        // The mixer thread leaves its readings for this thread to hand over.
+        audio::publish_reports();
+
         if (show_monitoring_overlay) {
             int graph_x = 10;
             int graph_y = 10;
@@ -1285,16 +1619,23 @@ int main(int argc, char** argv) {
     }
 
     // Unload all assets.
+    if (watching) {
+        destroy_file_watcher(&watcher);
+    }
     audio::stop_stream(test_music);
-    unload_atlas(&test_font_atlas);
+    unload_coverage_mask(&test_font_mask);
+    destroy_text_box(&dialogue_box);
+    destroy_text_layout_cache(&text_layout_cache);
     bm_font_unload(&test_font);
     unload_atlas(&atlas);
     unload_pixmap(display, icccm_icon);
 
     // Shutdown all systems.
+    jobs::shutdown();
     audio::shutdown();
     input::shutdown();
     monitoring::shutdown();
+    close_asset_pack();
 
     // Free and destroy any system resources.
     canvas_destroy(&canvas);
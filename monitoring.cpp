@@ -53,14 +53,21 @@ int64_t begin_period() {
 void end_period(int64_t start_time, const char* period_name) {
     int64_t end = read_time();
     int64_t duration = end - start_time;
+    add_reading(period_name, duration, 1);
+}
 
+void tick_counter(const char* name) {
+    add_ticks(name, 1);
+}
+
+void add_reading(const char* name, int64_t elapsed_total, int count) {
     lock();
 
     Chart::Slice* slice = chart.slices + chart.current_slice;
 
     Reading* reading = nullptr;
     for (int i = 0; i < slice->total_readings; ++i) {
-        if (strings_match(slice->readings[i].name, period_name)) {
+        if (strings_match(slice->readings[i].name, name)) {
             reading = slice->readings + i;
         }
     }
@@ -69,16 +76,16 @@ void end_period(int64_t start_time, const char* period_name) {
         slice->total_readings += 1;
         assert(slice->total_readings < MAX_READINGS);
         *reading = {};
-        reading->name = period_name;
+        reading->name = name;
     }
 
-    reading->count += 1;
-    reading->elapsed_total += duration;
+    reading->count += count;
+    reading->elapsed_total += elapsed_total;
 
     unlock();
 }
 
-void tick_counter(const char* name) {
+void add_ticks(const char* name, int ticks) {
     lock();
 
     Chart::Slice* slice = chart.slices + chart.current_slice;
@@ -97,7 +104,7 @@ void tick_counter(const char* name) {
         counter->name = name;
     }
 
-    counter->ticks += 1;
+    counter->ticks += ticks;
 
     unlock();
 }
@@ -34,6 +34,10 @@ void shutdown();
 int64_t begin_period();
 void end_period(int64_t start_time, const char* period_name);
 void tick_counter(const char* name);
+// For readings and counts taken somewhere that can't wait on the chart's
+// lock, and handed over later in a batch.
+void add_reading(const char* name, int64_t elapsed_total, int count);
+void add_ticks(const char* name, int ticks);
 void complete_frame();
 
 void lock();
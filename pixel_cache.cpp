@@ -0,0 +1,131 @@
+#include "pixel_cache.h"
+
+#include "logging.h"
+#include "string_utilities.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+// Every field is four bytes, in the byte order of the machine which wrote
+// the file, and the pixels follow straight after the header.
+
+#define PIXEL_CACHE_MAGIC 0x58504D41 // "AMPX"
+#define PIXEL_CACHE_VERSION 1
+#define PIXEL_CACHE_DIRECTORY "Cache"
+
+struct PixelCacheHeader {
+    u32 magic;
+    u32 version;
+    u32 key_low;
+    u32 key_high;
+    u32 width;
+    u32 height;
+};
+
+// 64-bit FNV-1a
+u64 hash_pixel_source(const void* contents, std::size_t size) {
+    const u8* bytes = static_cast<const u8*>(contents);
+    u64 hash = 0xCBF29CE484222325;
+    for (std::size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+// The file is named after the image's path rather than its contents, so that
+// caching an edited image writes over what was cached for it before, instead
+// of leaving it behind.
+static void get_cache_filename(char* filename, std::size_t size,
+                               const char* path) {
+    u64 path_hash = hash_pixel_source(path, string_size(path));
+    std::snprintf(filename, size, PIXEL_CACHE_DIRECTORY "/%016llx.pixels",
+                  static_cast<unsigned long long>(path_hash));
+}
+
+bool load_cached_pixels(CachedPixels* cached, const char* path, u64 key) {
+    cached->pixels = nullptr;
+    cached->width = 0;
+    cached->height = 0;
+
+    char filename[64];
+    get_cache_filename(filename, sizeof filename, path);
+    FileMapping mapping;
+    if (!map_file(&mapping, filename)) {
+        return false;
+    }
+
+    // Anything that doesn't match, like the pixels of the image before it
+    // was edited, is treated like it was never cached, and gets written over
+    // once the image is decoded again.
+    const PixelCacheHeader* header =
+        static_cast<const PixelCacheHeader*>(mapping.data);
+    if (mapping.size < sizeof *header ||
+            header->magic != PIXEL_CACHE_MAGIC ||
+            header->version != PIXEL_CACHE_VERSION ||
+            header->key_low != static_cast<u32>(key) ||
+            header->key_high != static_cast<u32>(key >> 32) ||
+            mapping.size - sizeof *header !=
+                sizeof(u32) * header->width * header->height) {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    cached->mapping = mapping;
+    cached->pixels = reinterpret_cast<const u32*>(header + 1);
+    cached->width = header->width;
+    cached->height = header->height;
+    return true;
+}
+
+void unload_cached_pixels(CachedPixels* cached) {
+    unmap_file(&cached->mapping);
+    cached->pixels = nullptr;
+}
+
+bool save_cached_pixels(const char* path, u64 key, const u32* pixels,
+                        int width, int height) {
+    if (mkdir(PIXEL_CACHE_DIRECTORY, 0755) == -1 && errno != EEXIST) {
+        LOG_ERROR("Couldn't make the directory " PIXEL_CACHE_DIRECTORY
+                  " to cache decoded images in.");
+        return false;
+    }
+
+    // The pixels are written to a file of their own and then renamed into
+    // place, so a file that's only part written is never mapped, even if the
+    // same image is being cached from elsewhere at the same time.
+    char filename[64];
+    char temporary_filename[80];
+    get_cache_filename(filename, sizeof filename, path);
+    std::snprintf(temporary_filename, sizeof temporary_filename, "%s.%d.%p",
+                  filename, static_cast<int>(getpid()),
+                  static_cast<const void*>(pixels));
+
+    std::FILE* file = std::fopen(temporary_filename, "wb");
+    if (!file) {
+        return false;
+    }
+
+    PixelCacheHeader header;
+    header.magic = PIXEL_CACHE_MAGIC;
+    header.version = PIXEL_CACHE_VERSION;
+    header.key_low = static_cast<u32>(key);
+    header.key_high = static_cast<u32>(key >> 32);
+    header.width = width;
+    header.height = height;
+    std::size_t pixel_count = static_cast<std::size_t>(width) * height;
+    bool written =
+        std::fwrite(&header, sizeof header, 1, file) == 1 &&
+        std::fwrite(pixels, sizeof(u32) * pixel_count, 1, file) == 1;
+    if (std::fclose(file) != 0) {
+        written = false;
+    }
+
+    if (!written || std::rename(temporary_filename, filename) != 0) {
+        std::remove(temporary_filename);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "file_mapping.h"
+#include "sized_types.h"
+
+#include <cstddef>
+
+// Images are kept on disk once decoded, as the 32-bit pixels the canvas is
+// drawn with, so that loading the same image again is only mapping its pixels
+// in rather than decoding it. Each image has one file in the cache, found by
+// its path and checked against a hash of its contents, so editing an image is
+// never answered with stale pixels, and its new pixels replace the old ones.
+
+struct CachedPixels {
+    FileMapping mapping;
+    const u32* pixels; // within the mapping
+    int width;
+    int height;
+};
+
+u64 hash_pixel_source(const void* contents, std::size_t size);
+bool load_cached_pixels(CachedPixels* cached, const char* path, u64 key);
+void unload_cached_pixels(CachedPixels* cached);
+bool save_cached_pixels(const char* path, u64 key, const u32* pixels,
+                        int width, int height);
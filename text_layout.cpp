@@ -0,0 +1,553 @@
+#include "text_layout.h"
+
+#include "string_utilities.h"
+#include "unicode.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#define ALLOCATE(type, count) \
+    static_cast<type*>(std::malloc(sizeof(type) * (count)))
+
+#define DEALLOCATE(memory) \
+    std::free(memory)
+
+// Character Classification Functions..........................................
+
+/*
+Distinguishes characters which have no visible mark or glyph. This is as
+opposed to "whitespace" characters, which includes the ogham space mark
+conditionally displayed as a glyph depending on context.
+*/
+static bool is_character_non_displayable(char32_t codepoint) {
+    switch (codepoint) {
+        case 0x9: // character tabulation
+        case 0xA: // line feed
+        case 0xB: // line tabulation
+        case 0xC: // form feed
+        case 0xD: // carriage return
+        case 0x20: // space
+        case 0x85: // next line
+        case 0xA0: // no-break space
+        case 0x2000: // en quad
+        case 0x2001: // em quad
+        case 0x2002: // en space
+        case 0x2003: // em space
+        case 0x2004: // three-per-em space
+        case 0x2005: // four-per-em space
+        case 0x2006: // six-per-em space
+        case 0x2007: // figure space
+        case 0x2008: // punctuation space
+        case 0x2009: // thin space
+        case 0x200A: // hair space
+        case 0x2028: // line separator
+        case 0x2029: // paragraph separator
+        case 0x202F: // narrow no-break space
+        case 0x205F: // medium mathematical space
+        case 0x3000: // ideographic space
+            return true;
+    }
+    return false;
+}
+
+// Whether a line can be broken after a character, which is the case for the
+// spaces that aren't meant to hold words together.
+static bool is_break_after(char32_t codepoint) {
+    switch (codepoint) {
+        case 0xA0: // no-break space
+        case 0x2007: // figure space
+        case 0x202F: // narrow no-break space
+            return false;
+    }
+    return is_character_non_displayable(codepoint);
+}
+
+// Ideographs are written without spaces, so a line can be broken before any
+// of them.
+static bool is_ideograph(char32_t codepoint) {
+    return (codepoint >= 0x3040 && codepoint <= 0x30FF) // hiragana and katakana
+        || (codepoint >= 0x3400 && codepoint <= 0x4DBF) // CJK extension A
+        || (codepoint >= 0x4E00 && codepoint <= 0x9FFF) // CJK unified ideographs
+        || (codepoint >= 0xF900 && codepoint <= 0xFAFF); // CJK compatibility
+}
+
+// Gives the size in bytes of the line break at the start of some UTF-8 text,
+// or zero if there isn't one there. A carriage return and line feed together
+// are one line break.
+//
+// @Incomplete: This doesn't fully handle Unicode line breaks. If this turns
+// out to be insufficient, check the Lattice project for how to do more
+// complete line-break handling.
+static int line_break_size(const char* text) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text);
+    switch (s[0]) {
+        case 0xA: // line feed
+        case 0xC: // form feed
+            return 1;
+        case 0xD: // carriage return
+            return (s[1] == 0xA) ? 2 : 1;
+        case 0xC2: // next line is C2 85
+            return (s[1] == 0x85) ? 2 : 0;
+        case 0xE2: // line and paragraph separators are E2 80 A8 and E2 80 A9
+            return (s[1] == 0x80 && (s[2] == 0xA8 || s[2] == 0xA9)) ? 3 : 0;
+    }
+    return 0;
+}
+
+// Paragraph Layout Functions..................................................
+
+static int grow_capacity(int capacity, int count) {
+    if (capacity < 16) {
+        capacity = 16;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+#define ENSURE_CAPACITY(array, capacity, count)                           \
+    do {                                                                  \
+        if ((count) > (capacity)) {                                       \
+            (capacity) = grow_capacity((capacity), (count));              \
+            (array) = static_cast<decltype(array)>(                       \
+                std::realloc((array), sizeof(*(array)) * (capacity)));    \
+        }                                                                 \
+    } while (0)
+
+static void destroy_paragraph(TextParagraph* paragraph) {
+    DEALLOCATE(paragraph->text);
+    DEALLOCATE(paragraph->codepoints);
+    DEALLOCATE(paragraph->quads);
+    DEALLOCATE(paragraph->lines);
+}
+
+// Ends a line at the given quad, moving its quads over to line it up.
+static void end_line(TextParagraph* paragraph, int first_codepoint,
+                     int first_quad, int end_quad, int line_width,
+                     int box_width, TextAlignment alignment) {
+    int shift = 0;
+    if (box_width > 0) {
+        switch (alignment) {
+            case TextAlignment::Left:   shift = 0; break;
+            case TextAlignment::Centre: shift = (box_width - line_width) / 2; break;
+            case TextAlignment::Right:  shift = box_width - line_width; break;
+        }
+    }
+    for (int i = first_quad; i < end_quad; ++i) {
+        paragraph->quads[i].x += shift;
+    }
+
+    ENSURE_CAPACITY(paragraph->lines, paragraph->line_capacity,
+                    paragraph->line_count + 1);
+    TextParagraph::Line* line = &paragraph->lines[paragraph->line_count];
+    line->first_codepoint = first_codepoint;
+    line->first_quad = first_quad;
+    line->width = line_width;
+    paragraph->line_count += 1;
+}
+
+// Lays out the lines of a paragraph from the given line on, keeping those
+// before it. Lines are filled greedily: a line is broken at the last place it
+// could be before the first glyph that doesn't fit, or right before that
+// glyph if a single word is too wide for a line.
+static void lay_out_lines(TextParagraph* paragraph, BmFont* font,
+                          int box_width, TextAlignment alignment,
+                          int first_line) {
+    int line_start = 0;
+    int line_quad_start = 0;
+    if (first_line < paragraph->line_count) {
+        line_start = paragraph->lines[first_line].first_codepoint;
+        line_quad_start = paragraph->lines[first_line].first_quad;
+    } else {
+        first_line = 0;
+    }
+    paragraph->line_count = first_line;
+    paragraph->quad_count = line_quad_start;
+
+    struct { int x, y; } pen;
+    pen.x = 0;
+    pen.y = first_line * font->leading;
+
+    // Where the line could last have been broken: the codepoint the next
+    // line would start at, how many quads go on this line, and its width.
+    struct { int next; int quad_count; int width; } last_break;
+    last_break.next = -1;
+
+    int line_width = 0;
+    char32_t prior_char = 0x0;
+    for (int i = line_start; i < paragraph->codepoint_count; ++i) {
+        char32_t c = paragraph->codepoints[i];
+        BmFont::Glyph* glyph = bm_font_get_character_mapping(font, c);
+
+        pen.x += bm_font_get_kerning(font, prior_char, c);
+
+        if (is_character_non_displayable(c)) {
+            pen.x += glyph->x_advance;
+            if (is_break_after(c)) {
+                last_break.next = i + 1;
+                last_break.quad_count = paragraph->quad_count;
+                last_break.width = line_width;
+            }
+        } else {
+            if (is_ideograph(c) && i > line_start) {
+                last_break.next = i;
+                last_break.quad_count = paragraph->quad_count;
+                last_break.width = line_width;
+            }
+
+            int right = pen.x + glyph->x_offset + glyph->texcoord.width;
+            if (box_width > 0 && right > box_width && i > line_start) {
+                // Break at the last opportunity on the line, or failing that
+                // right here, then take up again from the start of the new
+                // line.
+                int next = i;
+                int end_quad = paragraph->quad_count;
+                int width = line_width;
+                if (last_break.next > line_start) {
+                    next = last_break.next;
+                    end_quad = last_break.quad_count;
+                    width = last_break.width;
+                }
+                end_line(paragraph, line_start, line_quad_start, end_quad,
+                         width, box_width, alignment);
+                paragraph->quad_count = end_quad;
+
+                line_start = next;
+                line_quad_start = end_quad;
+                pen.x = 0;
+                pen.y += font->leading;
+                line_width = 0;
+                last_break.next = -1;
+                prior_char = 0x0;
+                i = next - 1;
+                continue;
+            }
+
+            ENSURE_CAPACITY(paragraph->quads, paragraph->quad_capacity,
+                            paragraph->quad_count + 1);
+            TextLayout::Quad* quad = &paragraph->quads[paragraph->quad_count];
+            quad->x = pen.x + glyph->x_offset;
+            quad->y = pen.y + glyph->y_offset;
+            quad->texcoord = glyph->texcoord;
+            paragraph->quad_count += 1;
+            line_width = right;
+            pen.x += font->tracking + glyph->x_advance;
+        }
+
+        prior_char = c;
+    }
+
+    end_line(paragraph, line_start, line_quad_start, paragraph->quad_count,
+             line_width, box_width, alignment);
+}
+
+// Decodes the paragraph's text again, then lays it out from the given line.
+static void reflow_paragraph(TextBox* box, TextParagraph* paragraph,
+                             int first_line) {
+    ENSURE_CAPACITY(paragraph->codepoints, paragraph->codepoint_capacity,
+                    paragraph->text_size);
+    paragraph->codepoint_count =
+        utf8_to_utf32(paragraph->text, paragraph->text_size,
+                      paragraph->codepoints, paragraph->text_size);
+    lay_out_lines(paragraph, box->font, box->width, box->alignment,
+                  first_line);
+}
+
+static void append_paragraph_text(TextBox* box, TextParagraph* paragraph,
+                                  const char* text, int size) {
+    if (size > 0) {
+        ENSURE_CAPACITY(paragraph->text, paragraph->text_capacity,
+                        paragraph->text_size + size);
+        std::memcpy(paragraph->text + paragraph->text_size, text, size);
+        paragraph->text_size += size;
+    }
+
+    // Appending can't change where the lines before the last were broken,
+    // since each of those ended before a glyph that didn't fit. The exception
+    // is text which was cut off partway through a UTF-8 sequence. The
+    // replacement character it ended with can be what pushed the last line
+    // down, and it's now some other character, so the line before has to be
+    // laid out again too.
+    int first_line = paragraph->line_count - 1;
+    int last = paragraph->codepoint_count - 1;
+    if (last >= 0 && paragraph->codepoints[last] == 0xFFFD) {
+        first_line -= 1;
+    }
+    reflow_paragraph(box, paragraph, (first_line > 0) ? first_line : 0);
+}
+
+static void set_paragraph_text(TextBox* box, TextParagraph* paragraph,
+                               const char* text, int size) {
+    paragraph->text_size = 0;
+    paragraph->line_count = 0;
+    append_paragraph_text(box, paragraph, text, size);
+}
+
+static TextParagraph* add_paragraph(TextBox* box) {
+    ENSURE_CAPACITY(box->paragraphs, box->paragraph_capacity,
+                    box->paragraph_count + 1);
+    TextParagraph* paragraph = &box->paragraphs[box->paragraph_count];
+    std::memset(paragraph, 0, sizeof *paragraph);
+    box->paragraph_count += 1;
+    return paragraph;
+}
+
+// Text Box Functions..........................................................
+
+// Finds where the paragraph starting at the given text ends, and how long the
+// line break after it is.
+static int find_paragraph_end(const char* text, int* break_size) {
+    int size = 0;
+    *break_size = 0;
+    while (text[size] && !(*break_size = line_break_size(text + size))) {
+        size += 1;
+    }
+    return size;
+}
+
+void create_text_box(TextBox* box, BmFont* font, int width,
+                     TextAlignment alignment) {
+    box->font = font;
+    box->width = width;
+    box->alignment = alignment;
+    box->paragraphs = nullptr;
+    box->paragraph_count = 0;
+    box->paragraph_capacity = 0;
+    box->after_carriage_return = false;
+}
+
+void destroy_text_box(TextBox* box) {
+    for (int i = 0; i < box->paragraph_count; ++i) {
+        destroy_paragraph(&box->paragraphs[i]);
+    }
+    DEALLOCATE(box->paragraphs);
+}
+
+// Whether the text ends in a carriage return, which a line feed appended
+// later would go along with to make a single line break.
+static bool ends_in_carriage_return(const char* text) {
+    int size = string_size(text);
+    return size > 0 && text[size - 1] == '\r';
+}
+
+void set_text_box_text(TextBox* box, const char* text) {
+    box->after_carriage_return = ends_in_carriage_return(text);
+
+    int count = 0;
+    for (;;) {
+        int break_size;
+        int size = find_paragraph_end(text, &break_size);
+
+        if (count < box->paragraph_count) {
+            TextParagraph* paragraph = &box->paragraphs[count];
+            if (paragraph->text_size != size || (size > 0 &&
+                    std::memcmp(paragraph->text, text, size) != 0)) {
+                set_paragraph_text(box, paragraph, text, size);
+            }
+        } else {
+            set_paragraph_text(box, add_paragraph(box), text, size);
+        }
+        count += 1;
+
+        if (!break_size) {
+            break;
+        }
+        text += size + break_size;
+    }
+
+    for (int i = count; i < box->paragraph_count; ++i) {
+        destroy_paragraph(&box->paragraphs[i]);
+    }
+    box->paragraph_count = count;
+}
+
+void append_text_box_text(TextBox* box, const char* text) {
+    if (box->paragraph_count == 0) {
+        set_text_box_text(box, text);
+        return;
+    }
+    if (box->after_carriage_return && text[0] == '\n') {
+        text += 1;
+    }
+    box->after_carriage_return = ends_in_carriage_return(text);
+
+    int break_size;
+    int size = find_paragraph_end(text, &break_size);
+    TextParagraph* last = &box->paragraphs[box->paragraph_count - 1];
+    if (size > 0) {
+        append_paragraph_text(box, last, text, size);
+    }
+    while (break_size) {
+        text += size + break_size;
+        size = find_paragraph_end(text, &break_size);
+        set_paragraph_text(box, add_paragraph(box), text, size);
+    }
+}
+
+// Text Layout Functions.......................................................
+
+void lay_out_text(TextLayout* layout, BmFont* font, const char* text,
+                  int wrap_width) {
+    TextBox box;
+    create_text_box(&box, font, wrap_width, TextAlignment::Left);
+    set_text_box_text(&box, text);
+
+    int quad_count = 0;
+    for (int i = 0; i < box.paragraph_count; ++i) {
+        quad_count += box.paragraphs[i].quad_count;
+    }
+    layout->quads = ALLOCATE(TextLayout::Quad, quad_count);
+    layout->quad_count = 0;
+
+    int y = 0;
+    for (int i = 0; i < box.paragraph_count; ++i) {
+        TextParagraph* paragraph = &box.paragraphs[i];
+        for (int j = 0; j < paragraph->quad_count; ++j) {
+            TextLayout::Quad* quad = &layout->quads[layout->quad_count];
+            *quad = paragraph->quads[j];
+            quad->y += y;
+            layout->quad_count += 1;
+        }
+        y += paragraph->line_count * font->leading;
+    }
+
+    destroy_text_box(&box);
+}
+
+void destroy_text_layout(TextLayout* layout) {
+    DEALLOCATE(layout->quads);
+}
+
+// Text Layout Cache Functions.................................................
+
+#define TEXT_LAYOUT_CACHE_INITIAL_SLOTS 64 // must be a power of two
+#define TEXT_LAYOUT_MAX_AGE 120 // in frames
+
+// FNV-1a over the text, then the other parts of the key.
+static uint32_t hash_key(BmFont* font, const char* text, int wrap_width) {
+    uint32_t hash = 0x811C9DC5;
+    for (const char* c = text; *c; ++c) {
+        hash ^= static_cast<unsigned char>(*c);
+        hash *= 0x01000193;
+    }
+    hash ^= static_cast<uint32_t>(wrap_width);
+    hash *= 0x01000193;
+    hash ^= static_cast<uint32_t>(reinterpret_cast<uintptr_t>(font) >> 4);
+    hash *= 0x01000193;
+    return hash;
+}
+
+static TextLayoutCache::Entry* find_slot(TextLayoutCache::Entry* entries,
+                                         int slot_count, uint32_t hash) {
+    int mask = slot_count - 1;
+    int probe = hash & mask;
+    while (entries[probe].text) {
+        probe = (probe + 1) & mask;
+    }
+    return &entries[probe];
+}
+
+// Moves the entries into a table of the given size, dropping any which
+// haven't been used in a while.
+static void rebuild_table(TextLayoutCache* cache, int slot_count) {
+    TextLayoutCache::Entry* entries = ALLOCATE(TextLayoutCache::Entry,
+                                               slot_count);
+    std::memset(entries, 0, sizeof(TextLayoutCache::Entry) * slot_count);
+
+    int entry_count = 0;
+    for (int i = 0; i < cache->slot_count; ++i) {
+        TextLayoutCache::Entry* entry = &cache->entries[i];
+        if (!entry->text) {
+            continue;
+        }
+        if (cache->frame - entry->last_used > TEXT_LAYOUT_MAX_AGE) {
+            DEALLOCATE(entry->text);
+            destroy_text_layout(&entry->layout);
+        } else {
+            *find_slot(entries, slot_count, entry->hash) = *entry;
+            entry_count += 1;
+        }
+    }
+
+    DEALLOCATE(cache->entries);
+    cache->entries = entries;
+    cache->slot_count = slot_count;
+    cache->entry_count = entry_count;
+}
+
+void create_text_layout_cache(TextLayoutCache* cache) {
+    int slot_count = TEXT_LAYOUT_CACHE_INITIAL_SLOTS;
+    cache->entries = ALLOCATE(TextLayoutCache::Entry, slot_count);
+    std::memset(cache->entries, 0,
+                sizeof(TextLayoutCache::Entry) * slot_count);
+    cache->slot_count = slot_count;
+    cache->entry_count = 0;
+    cache->frame = 0;
+}
+
+void destroy_text_layout_cache(TextLayoutCache* cache) {
+    for (int i = 0; i < cache->slot_count; ++i) {
+        TextLayoutCache::Entry* entry = &cache->entries[i];
+        if (entry->text) {
+            DEALLOCATE(entry->text);
+            destroy_text_layout(&entry->layout);
+        }
+    }
+    DEALLOCATE(cache->entries);
+}
+
+TextLayout get_text_layout(TextLayoutCache* cache, BmFont* font,
+                           const char* text, int wrap_width) {
+    uint32_t hash = hash_key(font, text, wrap_width);
+
+    int mask = cache->slot_count - 1;
+    for (int probe = hash & mask; cache->entries[probe].text;
+            probe = (probe + 1) & mask) {
+        TextLayoutCache::Entry* entry = &cache->entries[probe];
+        if (entry->hash == hash && entry->font == font &&
+                entry->wrap_width == wrap_width &&
+                strings_match(entry->text, text)) {
+            entry->last_used = cache->frame;
+            return entry->layout;
+        }
+    }
+
+    // Keep the table at most three-quarters full, so probe sequences stay
+    // short.
+    if (4 * (cache->entry_count + 1) > 3 * cache->slot_count) {
+        rebuild_table(cache, 2 * cache->slot_count);
+    }
+
+    TextLayoutCache::Entry* entry = find_slot(cache->entries,
+                                              cache->slot_count, hash);
+    std::size_t text_size = string_size(text) + 1;
+    entry->text = ALLOCATE(char, text_size);
+    std::memcpy(entry->text, text, text_size);
+    entry->font = font;
+    entry->wrap_width = wrap_width;
+    entry->hash = hash;
+    entry->last_used = cache->frame;
+    lay_out_text(&entry->layout, font, text, wrap_width);
+    cache->entry_count += 1;
+
+    return entry->layout;
+}
+
+void age_text_layouts(TextLayoutCache* cache) {
+    cache->frame += 1;
+
+    bool any_stale = false;
+    for (int i = 0; i < cache->slot_count; ++i) {
+        TextLayoutCache::Entry* entry = &cache->entries[i];
+        if (entry->text &&
+                cache->frame - entry->last_used > TEXT_LAYOUT_MAX_AGE) {
+            any_stale = true;
+            break;
+        }
+    }
+    if (any_stale) {
+        rebuild_table(cache, cache->slot_count);
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "font.h"
+
+// A string laid out in some font, as the glyph quads to draw for it.
+struct TextLayout {
+    struct Quad {
+        int x, y; // relative to where the text is drawn
+        BmFont::Glyph::Texcoord texcoord;
+    };
+
+    Quad* quads;
+    int quad_count;
+};
+
+// Passing a wrap width of zero only breaks lines at line break characters.
+void lay_out_text(TextLayout* layout, BmFont* font, const char* text,
+                  int wrap_width);
+void destroy_text_layout(TextLayout* layout);
+
+enum class TextAlignment {
+    Left,
+    Centre,
+    Right,
+};
+
+// The text between two line breaks, wrapped into lines.
+struct TextParagraph {
+    struct Line {
+        int first_codepoint;
+        int first_quad;
+        int width;
+    };
+
+    char* text; // UTF-8, without the line breaks
+    int text_size;
+    int text_capacity;
+    char32_t* codepoints;
+    int codepoint_count;
+    int codepoint_capacity;
+    TextLayout::Quad* quads; // relative to the top of the paragraph
+    int quad_count;
+    int quad_capacity;
+    Line* lines;
+    int line_count;
+    int line_capacity;
+};
+
+// Text laid out to fit a box of some width, kept a paragraph at a time. When
+// the text changes, only the paragraphs which changed are laid out again, and
+// appending to the text only lays out the last line again.
+struct TextBox {
+    BmFont* font;
+    int width; // or zero to only break lines at line break characters
+    TextAlignment alignment;
+    TextParagraph* paragraphs;
+    int paragraph_count;
+    int paragraph_capacity;
+    bool after_carriage_return;
+};
+
+void create_text_box(TextBox* box, BmFont* font, int width,
+                     TextAlignment alignment);
+void destroy_text_box(TextBox* box);
+void set_text_box_text(TextBox* box, const char* text);
+void append_text_box_text(TextBox* box, const char* text);
+
+// Holds on to the layouts of recently drawn text, so that text drawn the same
+// way each frame is only ever laid out once. Layouts not asked for in a while
+// are thrown out at the end of a frame, so a layout gotten from the cache is
+// good until then.
+struct TextLayoutCache {
+    struct Entry {
+        BmFont* font;
+        char* text;
+        int wrap_width;
+        unsigned int hash;
+        unsigned int last_used;
+        TextLayout layout;
+    };
+
+    Entry* entries;
+    int slot_count;
+    int entry_count;
+    unsigned int frame;
+};
+
+void create_text_layout_cache(TextLayoutCache* cache);
+void destroy_text_layout_cache(TextLayoutCache* cache);
+TextLayout get_text_layout(TextLayoutCache* cache, BmFont* font,
+                           const char* text, int wrap_width);
+void age_text_layouts(TextLayoutCache* cache);
@@ -1,5 +1,9 @@
 #include "unicode.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 char16_t* utf8_to_utf16(const char* s, char16_t* buffer, std::size_t count) {
     const unsigned char* str = reinterpret_cast<const unsigned char*>(s);
     --count;
@@ -97,31 +101,91 @@ char* utf16_to_utf8(const char16_t* str, char* buffer, std::size_t count) {
     return buffer;
 }
 
-static char32_t utf32_at_internal(const char* cur, std::size_t* num_read) {
-    const char first_char = *cur;
-    if ((first_char & 0x80) == 0) {
-        // ASCII
-        *num_read = 1;
-        return *cur;
+// The number of bytes in a sequence starting with each byte, or zero for
+// bytes which can't start one: continuation bytes, the overlong leads C0 and
+// C1, and leads of codepoints past U+10FFFF.
+static const unsigned char utf8_sequence_sizes[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+// Decodes one multibyte sequence, giving how many bytes it used. A malformed
+// sequence decodes to the replacement character and uses only the bytes up to
+// where it went wrong, so that each maximal malformed part of the text turns
+// into one replacement character.
+static std::size_t decode_sequence(const unsigned char* cur,
+                                   const unsigned char* end, char32_t* out) {
+    unsigned char lead = cur[0];
+    std::size_t size = utf8_sequence_sizes[lead];
+    if (size == 0) {
+        *out = 0xFFFD;
+        return 1;
+    }
+
+    // Only the second byte is restricted beyond being a continuation byte,
+    // which rules out overlong forms, surrogates and anything past U+10FFFF.
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    switch (lead) {
+        case 0xE0: low = 0xA0; break;
+        case 0xED: high = 0x9F; break;
+        case 0xF0: low = 0x90; break;
+        case 0xF4: high = 0x8F; break;
     }
-    ++cur;
-
-    std::size_t num_to_read = 0;
-    char32_t mask, to_ignore_mask;
-    char32_t codepoint = first_char;
-    for (num_to_read = 1, mask = 0x40, to_ignore_mask = 0xFFFFFF80;
-         first_char & mask;
-         ++num_to_read, to_ignore_mask |= mask, mask >>= 1) {
-        // 0x3F == 00111111
-        codepoint = (codepoint << 6) + (*cur++ & 0x3F);
+
+    // Well-formed sequences take the straight path. Checking each byte in
+    // turn is only needed to find where a malformed one goes wrong.
+    std::size_t available = end - cur;
+    if (available >= size && cur[1] >= low && cur[1] <= high) {
+        switch (size) {
+            case 2:
+                *out = (lead & 0x1F) << 6 | (cur[1] & 0x3F);
+                return 2;
+            case 3:
+                if ((cur[2] & 0xC0) == 0x80) {
+                    *out = (lead & 0x0F) << 12 | (cur[1] & 0x3F) << 6 |
+                           (cur[2] & 0x3F);
+                    return 3;
+                }
+                break;
+            case 4:
+                if ((cur[2] & 0xC0) == 0x80 && (cur[3] & 0xC0) == 0x80) {
+                    *out = (lead & 0x07) << 18 | (cur[1] & 0x3F) << 12 |
+                           (cur[2] & 0x3F) << 6 | (cur[3] & 0x3F);
+                    return 4;
+                }
+                break;
+        }
     }
-    to_ignore_mask |= mask;
-    codepoint &= ~(to_ignore_mask << (6 * (num_to_read - 1)));
 
-    *num_read = num_to_read;
-    return codepoint;
+    std::size_t i = 1;
+    if (i < available && cur[i] >= low && cur[i] <= high) {
+        for (i = 2; i < size && i < available; ++i) {
+            if ((cur[i] & 0xC0) != 0x80) {
+                break;
+            }
+        }
+    }
+    *out = 0xFFFD;
+    return i;
 }
 
+// Malformed sequences are replaced rather than rejected, so the result is
+// never more codepoints than there are bytes in the source.
 std::size_t utf8_to_utf32(const char* src, std::size_t src_len,
                           char32_t* dst, std::size_t dst_len) {
 
@@ -129,14 +193,46 @@ std::size_t utf8_to_utf32(const char* src, std::size_t src_len,
         return 0;
     }
 
-    const char* cur = src;
-    const char* end = src + src_len;
+    const unsigned char* cur = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = cur + src_len;
     char32_t* cur_utf32 = dst;
     const char32_t* end_utf32 = dst + dst_len;
-    while (cur_utf32 < end_utf32 && cur < end) {
-        std::size_t num_read;
-        *cur_utf32++ = utf32_at_internal(cur, &num_read);
-        cur += num_read;
+    while (cur < end && cur_utf32 < end_utf32) {
+        if (*cur >= 0x80) {
+            cur += decode_sequence(cur, end, cur_utf32);
+            cur_utf32 += 1;
+            continue;
+        }
+#if defined(__SSE2__)
+        // At the start of a run of ASCII, widen sixteen bytes at a time while
+        // they're all ASCII. When a block isn't, copy the ASCII before the
+        // first byte that isn't and go back to decoding sequences.
+        const __m128i zero = _mm_setzero_si128();
+        while (end - cur >= 16 && end_utf32 - cur_utf32 >= 16) {
+            __m128i bytes =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur));
+            int non_ascii = _mm_movemask_epi8(bytes);
+            if (non_ascii) {
+                for (int i = __builtin_ctz(non_ascii); i > 0; --i) {
+                    *cur_utf32++ = *cur++;
+                }
+                break;
+            }
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            __m128i* out = reinterpret_cast<__m128i*>(cur_utf32);
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+            cur += 16;
+            cur_utf32 += 16;
+        }
+        if (cur >= end || cur_utf32 >= end_utf32 || *cur >= 0x80) {
+            continue;
+        }
+#endif
+        *cur_utf32++ = *cur++;
     }
     if (cur_utf32 < end_utf32) {
         *cur_utf32 = 0;
@@ -1,11 +1,16 @@
 #include "wave_decoder.h"
 
-#include <cstdio>
+#include "file_mapping.h"
+
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <cassert>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #if defined(__GNUC__)
 #define ALWAYS_INLINE inline __attribute__((always_inline))
 #elif defined(_MSC_VER)
@@ -57,12 +62,17 @@ struct WaveDecoder {
         u32 start;
     } decoded;
     struct {
-        void* block;
+        void* block; // only used to pad out a truncated final ADPCM block
         u32 block_size;
     } encoded;
+    struct {
+        const u8* data;
+        u64 size;
+        u64 position;
+    } source;
 
-    s64 data_chunk_position; // where the data chunk is in the file, as an offset in bytes
-    std::FILE* file;
+    FileMapping mapping; // only set if the decoder opened the file itself
+    u64 data_chunk_position; // where the data chunk is in the file, as an offset in bytes
     bool end_of_file;
     u32 frame_count;
     u32 frames_left;
@@ -74,42 +84,122 @@ struct WaveDecoder {
     u8 channels;
 };
 
+static ALWAYS_INLINE u8 pull_u8(const void* buffer) {
+    return static_cast<const u8*>(buffer)[0];
+}
+
+static ALWAYS_INLINE u16 pull_u16(const void* buffer) {
+    const u8* b = static_cast<const u8*>(buffer);
+    u16 x;
+    x = b[0];
+    x += static_cast<u16>(b[1]) << 8;
+    return x;
+}
+
+static ALWAYS_INLINE u32 pull_u32(const void* buffer) {
+    const u8* b = static_cast<const u8*>(buffer);
+    u32 x;
+    x = b[0];
+    x += static_cast<u32>(b[1]) << 8;
+    x += static_cast<u32>(b[2]) << 16;
+    x += static_cast<u32>(b[3]) << 24;
+    return x;
+}
+
+static ALWAYS_INLINE float pull_float(const void* buffer) {
+    const u8* b = static_cast<const u8*>(buffer);
+    u32 x;
+    x = b[0];
+    x += static_cast<u32>(b[1]) << 8;
+    x += static_cast<u32>(b[2]) << 16;
+    x += static_cast<u32>(b[3]) << 24;
+    return *(reinterpret_cast<float*>(&x));
+}
+
+static ALWAYS_INLINE double pull_double(const void* buffer) {
+    const u8* b = static_cast<const u8*>(buffer);
+    u64 x;
+    x = b[0];
+    x += static_cast<u64>(b[1]) << 8;
+    x += static_cast<u64>(b[2]) << 16;
+    x += static_cast<u64>(b[3]) << 24;
+    x += static_cast<u64>(b[4]) << 32;
+    x += static_cast<u64>(b[5]) << 40;
+    x += static_cast<u64>(b[6]) << 48;
+    x += static_cast<u64>(b[7]) << 56;
+    return *(reinterpret_cast<double*>(&x));
+}
+
+// Source Reading Functions....................................................
+//     The whole file is in memory, whether mapped in by wave_open_file or
+//     handed over to wave_open_memory, so reading is only a matter of moving
+//     a position along it.
+
+static ALWAYS_INLINE bool bytes_available(WaveDecoder* decoder,
+                                         std::size_t bytes) {
+    return decoder->source.size - decoder->source.position >= bytes;
+}
+
 static ALWAYS_INLINE u8 extract8(WaveDecoder* decoder) {
-   int byte = std::fgetc(decoder->file);
-   if (byte == EOF) {
-       decoder->end_of_file = true;
-       return 0;
-   }
-   return byte;
+    if (!bytes_available(decoder, 1)) {
+        decoder->end_of_file = true;
+        decoder->source.position = decoder->source.size;
+        return 0;
+    }
+    return decoder->source.data[decoder->source.position++];
 }
 
 static u16 extract16(WaveDecoder* decoder) {
-    u16 x;
-    x = extract8(decoder);
-    x += static_cast<u16>(extract8(decoder)) << 8;
+    if (!bytes_available(decoder, sizeof(u16))) {
+        decoder->end_of_file = true;
+        decoder->source.position = decoder->source.size;
+        return 0;
+    }
+    u16 x = pull_u16(decoder->source.data + decoder->source.position);
+    decoder->source.position += sizeof(u16);
     return x;
 }
 
 static u32 extract32(WaveDecoder* decoder) {
-    u32 x;
-    x = extract8(decoder);
-    x += static_cast<u32>(extract8(decoder)) << 8;
-    x += static_cast<u32>(extract8(decoder)) << 16;
-    x += static_cast<u32>(extract8(decoder)) << 24;
+    if (!bytes_available(decoder, sizeof(u32))) {
+        decoder->end_of_file = true;
+        decoder->source.position = decoder->source.size;
+        return 0;
+    }
+    u32 x = pull_u32(decoder->source.data + decoder->source.position);
+    decoder->source.position += sizeof(u32);
     return x;
 }
 
-static std::size_t extract_bytes(WaveDecoder* decoder, u8* data,
-                                 std::size_t bytes) {
-    std::size_t bytes_read = std::fread(data, 1, bytes, decoder->file);
-    if (bytes_read != bytes) {
+// Returns a pointer to the next run of bytes in the source, rather than
+// copying them anywhere, and moves past them. If fewer than the requested
+// number of bytes remain, the returned run is shortened to whatever's left.
+static const u8* view_bytes(WaveDecoder* decoder, std::size_t bytes,
+                            std::size_t* bytes_viewed) {
+    if (!bytes_available(decoder, bytes)) {
         decoder->end_of_file = true;
+        bytes = decoder->source.size - decoder->source.position;
     }
+    const u8* view = decoder->source.data + decoder->source.position;
+    decoder->source.position += bytes;
+    *bytes_viewed = bytes;
+    return view;
+}
+
+static std::size_t extract_bytes(WaveDecoder* decoder, u8* data,
+                                 std::size_t bytes) {
+    std::size_t bytes_read;
+    const u8* view = view_bytes(decoder, bytes, &bytes_read);
+    std::memcpy(data, view, bytes_read);
     return bytes_read;
 }
 
 static void skip_bytes(WaveDecoder* decoder, std::size_t bytes) {
-    std::fseek(decoder->file, bytes, SEEK_CUR);
+    if (!bytes_available(decoder, bytes)) {
+        decoder->source.position = decoder->source.size;
+    } else {
+        decoder->source.position += bytes;
+    }
 }
 
 static std::size_t get_ms_adpcm_specific(WaveDecoder* decoder) {
@@ -266,7 +356,7 @@ static bool ready_for_data_chunk(WaveDecoder* decoder, u32 chunk_size) {
         decoder->frame_count = chunk_size / decoder->block_alignment;
     }
 
-    decoder->data_chunk_position = ftell(decoder->file);
+    decoder->data_chunk_position = decoder->source.position;
     decoder->frames_left = decoder->frame_count;
 
     if (decoder->format == Format::MS_ADPCM) {
@@ -281,7 +371,9 @@ static bool ready_for_data_chunk(WaveDecoder* decoder, u32 chunk_size) {
         decoder->decoded.buffer_size = block_size;
     }
 
-    decoder->encoded.block = std::malloc(decoder->encoded.block_size);
+    if (decoder->format == Format::MS_ADPCM) {
+        decoder->encoded.block = std::calloc(1, decoder->encoded.block_size);
+    }
     decoder->decoded.buffer = std::malloc(decoder->decoded.buffer_size);
 
     decoder->decoded.frames = 0;
@@ -349,153 +441,140 @@ static bool determine_format_and_ready(WaveDecoder* decoder) {
     return false;
 }
 
+// The adaptive step size for the next sample is scaled by an amount picked
+// out by the current 4-bit code.
+static const s32 ms_adpcm_adaption_table[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+// The state of one channel is kept in locals by the block decoders below,
+// rather than behind a pointer, so the compiler can hold it in registers for
+// the whole block.
 struct MsAdpcmState {
-    u16 delta;
-    s16 sample1;
-    s16 sample2;
-    u8 predictor;
+    s32 delta;
+    s32 sample1;
+    s32 sample2;
+    s32 coefficient1;
+    s32 coefficient2;
 };
 
-static s16 ms_adpcm_decode_sample(MsAdpcmState* state, u8 code,
-                                  const s16* coefficient_set) {
+static ALWAYS_INLINE s16 ms_adpcm_decode_sample(MsAdpcmState* state,
+                                                u32 code) {
     const s32 MAX_S16 = 32767;
     const s32 MIN_S16 = -32768;
-    const s32 adaption_table[16] = {
-        230, 230, 230, 230, 307, 409, 512, 614,
-        768, 614, 512, 409, 307, 230, 230, 230
-    };
-
-    s32 predicted_sample;
-    predicted_sample = (state->sample1 * coefficient_set[0] +
-                        state->sample2 * coefficient_set[1]) / 256;
-    if (code & 0x08) {
-        predicted_sample += state->delta * (code - 0x10);
-    } else {
-        predicted_sample += state->delta * code;
-    }
+
+    // The prediction can be negative, and the specification asks for it to
+    // be rounded towards zero, so this division has to stay a division
+    // rather than becoming an arithmetic shift.
+    s32 predicted_sample = (state->sample1 * state->coefficient1 +
+                            state->sample2 * state->coefficient2) / 256;
+
+    // Sign-extend the 4-bit code.
+    s32 signed_code = static_cast<s32>(code ^ 0x8) - 0x8;
+    predicted_sample += state->delta * signed_code;
     if (predicted_sample < MIN_S16) {
         predicted_sample = MIN_S16;
     } else if (predicted_sample > MAX_S16) {
         predicted_sample = MAX_S16;
     }
 
-    s32 delta;
-    delta = (static_cast<s32>(state->delta) * adaption_table[code]) / 256;
+    // Both factors are positive here, so the shift is the same as dividing.
+    // The step size is also only ever stored as 16 bits in the stream format,
+    // which is mirrored here by the truncation.
+    s32 delta = (state->delta * ms_adpcm_adaption_table[code]) >> 8;
     if (delta < 16) {
         delta = 16;
     }
-
-    state->delta = delta;
+    state->delta = static_cast<u16>(delta);
     state->sample2 = state->sample1;
     state->sample1 = predicted_sample;
 
     return static_cast<s16>(predicted_sample);
 }
 
-static u32 ms_adpcm_decode_block(MsAdpcmData* adpcm_data, int channels,
-                                 u8* encoded, s16* decoded) {
-
-    u32 output_length = adpcm_data->frames_per_block * sizeof(s16) *
-                        channels;
-
-    MsAdpcmState* state[2];
-    MsAdpcmState decoder_state[2];
-    state[0] = &decoder_state[0];
-    if (channels == 2) {
-        state[1] = &decoder_state[1];
-    } else {
-        state[1] = &decoder_state[0];
-    }
-
-    for (int i = 0; i < channels; ++i) {
-        state[i]->predictor = *encoded++;
-        assert(state[i]->predictor < adpcm_data->num_coefficients);
-    }
-
-    for (int i = 0; i < channels; ++i) {
-        state[i]->delta = (encoded[1] << 8) | encoded[0];
-        encoded += sizeof(u16);
-    }
-
-    for (int i = 0; i < channels; ++i) {
-        state[i]->sample1 = (encoded[1] << 8) | encoded[0];
-        encoded += sizeof(s16);
-    }
-    for (int i = 0; i < channels; ++i) {
-        state[i]->sample2 = (encoded[1] << 8) | encoded[0];
-        encoded += sizeof(s16);
-    }
-
-    s16* coefficient[2];
-    coefficient[0] = adpcm_data->coefficients[state[0]->predictor];
-    coefficient[1] = adpcm_data->coefficients[state[1]->predictor];
+static ALWAYS_INLINE s32 ms_adpcm_pull_s16(const u8* encoded) {
+    return static_cast<s16>(pull_u16(encoded));
+}
 
-    for (int i = 0; i < channels; ++i) {
-        *decoded++ = state[i]->sample2;
+static void ms_adpcm_decode_block_mono(MsAdpcmData* adpcm_data,
+                                       const u8* encoded, s16* decoded) {
+    u8 predictor = encoded[0];
+    assert(predictor < adpcm_data->num_coefficients);
+
+    MsAdpcmState state;
+    state.delta = pull_u16(encoded + 1);
+    state.sample1 = ms_adpcm_pull_s16(encoded + 3);
+    state.sample2 = ms_adpcm_pull_s16(encoded + 5);
+    state.coefficient1 = adpcm_data->coefficients[predictor][0];
+    state.coefficient2 = adpcm_data->coefficients[predictor][1];
+    encoded += 7;
+
+    *decoded++ = state.sample2;
+    *decoded++ = state.sample1;
+
+    // Each byte holds two successive samples, high nibble first.
+    int samples_remaining = adpcm_data->frames_per_block - 2;
+    for (; samples_remaining >= 2; samples_remaining -= 2) {
+        u32 byte = *encoded++;
+        decoded[0] = ms_adpcm_decode_sample(&state, byte >> 4);
+        decoded[1] = ms_adpcm_decode_sample(&state, byte & 0x0F);
+        decoded += 2;
     }
-    for (int i = 0; i < channels; ++i) {
-        *decoded++ = state[i]->sample1;
+    if (samples_remaining > 0) {
+        *decoded = ms_adpcm_decode_sample(&state, *encoded >> 4);
     }
-
-    int samples_remaining = (adpcm_data->frames_per_block - 2) * channels;
-    while (samples_remaining > 0) {
-        u8 code;
-        code = *encoded >> 4;
-        *decoded++ = ms_adpcm_decode_sample(state[0], code, coefficient[0]);
-        code = *encoded & 0x0F;
-        *decoded++ = ms_adpcm_decode_sample(state[1], code, coefficient[1]);
-
-        ++encoded;
-        samples_remaining -= 2;
-    }
-
-    return output_length;
 }
 
-static ALWAYS_INLINE u8 pull_u8(const void* buffer) {
-    return static_cast<const u8*>(buffer)[0];
-}
-
-static ALWAYS_INLINE u16 pull_u16(const void* buffer) {
-    const u8* b = static_cast<const u8*>(buffer);
-    u16 x;
-    x = b[0];
-    x += static_cast<u16>(b[1]) << 8;
-    return x;
+static void ms_adpcm_decode_block_stereo(MsAdpcmData* adpcm_data,
+                                         const u8* encoded, s16* decoded) {
+    u8 left_predictor = encoded[0];
+    u8 right_predictor = encoded[1];
+    assert(left_predictor < adpcm_data->num_coefficients);
+    assert(right_predictor < adpcm_data->num_coefficients);
+
+    // The block header has each field for the left then the right channel.
+    MsAdpcmState left;
+    MsAdpcmState right;
+    left.delta = pull_u16(encoded + 2);
+    right.delta = pull_u16(encoded + 4);
+    left.sample1 = ms_adpcm_pull_s16(encoded + 6);
+    right.sample1 = ms_adpcm_pull_s16(encoded + 8);
+    left.sample2 = ms_adpcm_pull_s16(encoded + 10);
+    right.sample2 = ms_adpcm_pull_s16(encoded + 12);
+    left.coefficient1 = adpcm_data->coefficients[left_predictor][0];
+    left.coefficient2 = adpcm_data->coefficients[left_predictor][1];
+    right.coefficient1 = adpcm_data->coefficients[right_predictor][0];
+    right.coefficient2 = adpcm_data->coefficients[right_predictor][1];
+    encoded += 14;
+
+    decoded[0] = left.sample2;
+    decoded[1] = right.sample2;
+    decoded[2] = left.sample1;
+    decoded[3] = right.sample1;
+    decoded += 4;
+
+    // Each byte is one whole frame, with the left sample in the high nibble.
+    int frames_remaining = adpcm_data->frames_per_block - 2;
+    for (int i = 0; i < frames_remaining; ++i) {
+        u32 byte = encoded[i];
+        decoded[0] = ms_adpcm_decode_sample(&left, byte >> 4);
+        decoded[1] = ms_adpcm_decode_sample(&right, byte & 0x0F);
+        decoded += 2;
+    }
 }
 
-static ALWAYS_INLINE u32 pull_u32(const void* buffer) {
-    const u8* b = static_cast<const u8*>(buffer);
-    u32 x;
-    x = b[0];
-    x += static_cast<u32>(b[1]) << 8;
-    x += static_cast<u32>(b[2]) << 16;
-    x += static_cast<u32>(b[3]) << 24;
-    return x;
-}
+static u32 ms_adpcm_decode_block(MsAdpcmData* adpcm_data, int channels,
+                                 const u8* encoded, s16* decoded) {
+    assert(channels == 1 || channels == 2);
 
-static ALWAYS_INLINE float pull_float(const void* buffer) {
-    const u8* b = static_cast<const u8*>(buffer);
-    u32 x;
-    x = b[0];
-    x += static_cast<u32>(b[1]) << 8;
-    x += static_cast<u32>(b[2]) << 16;
-    x += static_cast<u32>(b[3]) << 24;
-    return *(reinterpret_cast<float*>(&x));
-}
+    if (channels == 2) {
+        ms_adpcm_decode_block_stereo(adpcm_data, encoded, decoded);
+    } else {
+        ms_adpcm_decode_block_mono(adpcm_data, encoded, decoded);
+    }
 
-static ALWAYS_INLINE double pull_double(const void* buffer) {
-    const u8* b = static_cast<const u8*>(buffer);
-    u64 x;
-    x = b[0];
-    x += static_cast<u64>(b[1]) << 8;
-    x += static_cast<u64>(b[2]) << 16;
-    x += static_cast<u64>(b[3]) << 24;
-    x += static_cast<u64>(b[4]) << 32;
-    x += static_cast<u64>(b[5]) << 40;
-    x += static_cast<u64>(b[6]) << 48;
-    x += static_cast<u64>(b[7]) << 56;
-    return *(reinterpret_cast<double*>(&x));
+    return adpcm_data->frames_per_block * sizeof(s16) * channels;
 }
 
 static std::size_t round_up(std::size_t x, std::size_t multiple) {
@@ -523,15 +602,14 @@ static void fetch_and_decode_block(WaveDecoder* decoder) {
         return;
     }
 
-    std::size_t bytes_got =
-            extract_bytes(decoder, static_cast<u8*>(decoder->encoded.block),
-                          bytes_requested);
+    std::size_t bytes_got;
+    const u8* block = view_bytes(decoder, bytes_requested, &bytes_got);
 
     // The bytes that are fetched from file are in little-endian order,
     // so for linear PCM formats, this is used to convert to native-endian
-    // order in-place inside the encoded buffer.
+    // order while copying them out of the source.
 #define STRAIGHTEN(type)                                                    \
-    const type* encoded = static_cast<const type*>(decoder->encoded.block); \
+    const type* encoded = reinterpret_cast<const type*>(block);             \
     type* decoded = static_cast<type*>(decoder->decoded.buffer);            \
     for (int i = 0; i < samples; ++i) {                                     \
         decoded[i] = pull_##type(encoded + i);                              \
@@ -560,8 +638,17 @@ static void fetch_and_decode_block(WaveDecoder* decoder) {
             break;
         }
         case Format::MS_ADPCM: {
+            if (bytes_got < decoder->encoded.block_size) {
+                // A truncated last block would have the decoder read past
+                // the end of the source, so pad it out with silence first.
+                u8* padded = static_cast<u8*>(decoder->encoded.block);
+                std::memcpy(padded, block, bytes_got);
+                std::memset(padded + bytes_got, 0,
+                            decoder->encoded.block_size - bytes_got);
+                block = padded;
+            }
             ms_adpcm_decode_block(&decoder->ms_adpcm_data, decoder->channels,
-                                  static_cast<u8*>(decoder->encoded.block),
+                                  block,
                                   static_cast<s16*>(decoder->decoded.buffer));
             decoded_frames = decoder->ms_adpcm_data.frames_per_block;
             if (decoded_frames > decoder->frames_left) {
@@ -605,6 +692,149 @@ static ALWAYS_INLINE float format_double(double value) {
     return static_cast<float>(value);
 }
 
+// Direct Conversion Functions.................................................
+//     These convert little-endian samples straight out of the source into
+//     floats, for when the file's channel layout already matches what's being
+//     asked for and there's no need for the intermediate decoded buffer.
+//     Each gives exactly the same result as the format_* function of its type.
+
+static void convert_u8_to_float(const u8* in, float* out, int count) {
+    const float scale = static_cast<float>(1.0 / 255.0);
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i x0 = _mm_unpacklo_epi16(low, zero);
+        __m128i x1 = _mm_unpackhi_epi16(low, zero);
+        __m128i x2 = _mm_unpacklo_epi16(high, zero);
+        __m128i x3 = _mm_unpackhi_epi16(high, zero);
+        _mm_storeu_ps(out + i,      _mm_mul_ps(_mm_cvtepi32_ps(x0), scale4));
+        _mm_storeu_ps(out + i + 4,  _mm_mul_ps(_mm_cvtepi32_ps(x1), scale4));
+        _mm_storeu_ps(out + i + 8,  _mm_mul_ps(_mm_cvtepi32_ps(x2), scale4));
+        _mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(x3), scale4));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = format_u8(in[i]);
+    }
+}
+
+static void convert_s16_to_float(const u8* in, float* out, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 scale4 = _mm_set1_ps(static_cast<float>(1.0 / 32767.5));
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+        // Sign-extend by putting each sample in the top half of a 32-bit
+        // lane and shifting it back down.
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        __m128 f0 = _mm_add_ps(_mm_cvtepi32_ps(low), half);
+        __m128 f1 = _mm_add_ps(_mm_cvtepi32_ps(high), half);
+        _mm_storeu_ps(out + i,     _mm_mul_ps(f0, scale4));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(f1, scale4));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = format_s16(static_cast<s16>(pull_u16(in + 2 * i)));
+    }
+}
+
+static void convert_s32_to_float(const u8* in, float* out, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 scale4 = _mm_set1_ps(static_cast<float>(1.0 / 2147483647.5));
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+        __m128 f = _mm_add_ps(_mm_cvtepi32_ps(x), half);
+        _mm_storeu_ps(out + i, _mm_mul_ps(f, scale4));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = format_s32(static_cast<s32>(pull_u32(in + 4 * i)));
+    }
+}
+
+static void convert_f32_to_float(const u8* in, float* out, int count) {
+#if defined(__SSE2__)
+    // Anything with SSE2 is little-endian, so this is only a copy.
+    std::memcpy(out, in, sizeof(float) * count);
+#else
+    for (int i = 0; i < count; ++i) {
+        out[i] = format_float(pull_float(in + 4 * i));
+    }
+#endif
+}
+
+static void convert_f64_to_float(const u8* in, float* out, int count) {
+    for (int i = 0; i < count; ++i) {
+        out[i] = format_double(pull_double(in + 8 * i));
+    }
+}
+
+static bool can_convert_directly(WaveDecoder* decoder, int out_channels) {
+    if (decoder->format == Format::MS_ADPCM ||
+        decoder->channels != out_channels ||
+        decoder->decoded.frames > 0) {
+        return false;
+    }
+    int bytes_per_sample = decoder->bits_per_sample / 8;
+    return decoder->block_alignment == bytes_per_sample * decoder->channels;
+}
+
+// Converts as many frames as possible from the source straight into the
+// buffer, skipping the intermediate decoded buffer altogether.
+static int convert_frames_directly(WaveDecoder* decoder, float* buffer,
+                                   int frame_count) {
+    u32 frames = frame_count;
+    if (frames > decoder->frames_left) {
+        frames = decoder->frames_left;
+    }
+
+    std::size_t bytes_got;
+    const u8* block = view_bytes(decoder, frames * decoder->block_alignment,
+                                 &bytes_got);
+    frames = bytes_got / decoder->block_alignment;
+    int samples = frames * decoder->channels;
+
+    switch (decoder->format) {
+        case Format::Integer: {
+            switch (decoder->bits_per_sample) {
+                case 8:  { convert_u8_to_float(block, buffer, samples);  break; }
+                case 16: { convert_s16_to_float(block, buffer, samples); break; }
+                case 32: { convert_s32_to_float(block, buffer, samples); break; }
+            }
+            break;
+        }
+        case Format::IEEE754_Float: {
+            switch (decoder->bits_per_sample) {
+                case 32: { convert_f32_to_float(block, buffer, samples); break; }
+                case 64: { convert_f64_to_float(block, buffer, samples); break; }
+            }
+            break;
+        }
+        default: {
+            assert(false);
+            break;
+        }
+    }
+
+    decoder->frames_left -= frames;
+    if (decoder->end_of_file) {
+        // The file was cut off partway through the data chunk, so there's
+        // nothing more to come.
+        decoder->frames_left = 0;
+    }
+
+    return frames;
+}
+
 int wave_decode_interleaved(WaveDecoder* decoder, int out_channels,
                             float* buffer, int sample_count) {
     int frames_decoded = 0;
@@ -630,16 +860,23 @@ int wave_decode_interleaved(WaveDecoder* decoder, int out_channels,
         }                                                         \
     }
 
+    if (can_convert_directly(decoder, out_channels)) {
+        return convert_frames_directly(decoder, buffer, frame_count);
+    }
+
     while (frames_remaining > 0) {
-        if (decoder->frames_left == 0) {
-            // The data chunk of the file has no more samples to
-            // decode.
-            break;
-        }
         if (decoder->decoded.frames == 0) {
+            if (decoder->frames_left == 0) {
+                // The data chunk of the file has no more samples to
+                // decode.
+                break;
+            }
             // If the intermediate buffer for encoded bytes is empty,
             // fetch another whole buffer-full from the file.
             fetch_and_decode_block(decoder);
+            if (decoder->decoded.frames == 0) {
+                break;
+            }
         }
 
         int frames = frames_remaining;
@@ -682,31 +919,80 @@ int wave_decode_interleaved(WaveDecoder* decoder, int out_channels,
 void wave_seek_start(WaveDecoder* decoder) {
     decoder->decoded.frames = 0;
     decoder->decoded.start = 0;
-    std::fseek(decoder->file, decoder->data_chunk_position, SEEK_SET);
+    decoder->source.position = decoder->data_chunk_position;
+    decoder->end_of_file = false;
     decoder->frames_left = decoder->frame_count;
 }
 
+void wave_seek(WaveDecoder* decoder, unsigned int frame) {
+    if (frame > decoder->frame_count) {
+        frame = decoder->frame_count;
+    }
+
+    // ADPCM can only be decoded from the start of a block, so seek to the
+    // block the frame is in and throw away the frames before it.
+    u32 frames_to_skip = 0;
+    if (decoder->format == Format::MS_ADPCM) {
+        u32 frames_per_block = decoder->ms_adpcm_data.frames_per_block;
+        frames_to_skip = frame % frames_per_block;
+        frame -= frames_to_skip;
+    }
+
+    u64 position;
+    if (decoder->format == Format::MS_ADPCM) {
+        u32 block = frame / decoder->ms_adpcm_data.frames_per_block;
+        position = static_cast<u64>(block) * decoder->block_alignment;
+    } else {
+        position = static_cast<u64>(frame) * decoder->block_alignment;
+    }
+    position += decoder->data_chunk_position;
+    if (position > decoder->source.size) {
+        position = decoder->source.size;
+    }
+
+    decoder->decoded.frames = 0;
+    decoder->decoded.start = 0;
+    decoder->source.position = position;
+    decoder->end_of_file = false;
+    decoder->frames_left = decoder->frame_count - frame;
+
+    if (frames_to_skip > 0) {
+        fetch_and_decode_block(decoder);
+        if (frames_to_skip > decoder->decoded.frames) {
+            frames_to_skip = decoder->decoded.frames;
+        }
+        decoder->decoded.start = frames_to_skip;
+        decoder->decoded.frames -= frames_to_skip;
+    }
+}
+
 int wave_channels(WaveDecoder* decoder) {
     return decoder->channels;
 }
 
-WaveDecoder* wave_open_file(const char* filename) {
+unsigned int wave_frame_count(WaveDecoder* decoder) {
+    return decoder->frame_count;
+}
+
+static WaveDecoder* open_source(const u8* data, std::size_t size,
+                                FileMapping* mapping) {
     WaveDecoder* decoder;
 
     decoder = static_cast<WaveDecoder*>(std::calloc(1, sizeof(WaveDecoder)));
     if (!decoder) {
         // Failed to allocate the memory needed to decode the wave file.
+        if (mapping) {
+            unmap_file(mapping);
+        }
         return nullptr;
     }
 
-    std::FILE* file;
-    file = std::fopen(filename, "rb");
-    if (!file) {
-        // The file was not able to be opened.
-        wave_close_file(decoder);
-        return nullptr;
+    if (mapping) {
+        decoder->mapping = *mapping;
     }
-    decoder->file = file;
+    decoder->source.data = data;
+    decoder->source.size = size;
+    decoder->source.position = 0;
 
     if (!determine_format_and_ready(decoder)) {
         // File was not of a supported format or was corrupted in some way that
@@ -718,11 +1004,23 @@ WaveDecoder* wave_open_file(const char* filename) {
     return decoder;
 }
 
+WaveDecoder* wave_open_file(const char* filename) {
+    FileMapping mapping;
+    if (!map_file(&mapping, filename)) {
+        // The file was not able to be opened.
+        return nullptr;
+    }
+    return open_source(static_cast<const u8*>(mapping.data), mapping.size,
+                       &mapping);
+}
+
+WaveDecoder* wave_open_memory(const void* data, std::size_t size) {
+    return open_source(static_cast<const u8*>(data), size, nullptr);
+}
+
 void wave_close_file(WaveDecoder* decoder) {
     if (decoder) {
-        if (decoder->file) {
-            std::fclose(decoder->file);
-        }
+        unmap_file(&decoder->mapping);
         if (decoder->encoded.block) {
             std::free(decoder->encoded.block);
         }
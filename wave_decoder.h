@@ -1,10 +1,15 @@
 #pragma once
 
+#include <cstddef>
+
 struct WaveDecoder;
 
 WaveDecoder* wave_open_file(const char* filename);
+WaveDecoder* wave_open_memory(const void* data, std::size_t size);
 void wave_close_file(WaveDecoder* decoder);
 int wave_decode_interleaved(WaveDecoder* decoder, int out_channels,
 							float* buffer, int sample_count);
 void wave_seek_start(WaveDecoder* decoder);
+void wave_seek(WaveDecoder* decoder, unsigned int frame);
 int wave_channels(WaveDecoder* decoder);
+unsigned int wave_frame_count(WaveDecoder* decoder);